@@ -3,6 +3,176 @@
 #include <vector>
 #include <fstream>
 #include <string>
+#include <chrono>
+#include <memory>
+#include <cstring>
+#include <iomanip>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <future>
+#include <unordered_map>
+#include <utility>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <system_error>
+#include <thread>
+#include <cerrno>
+#include <cstdint>
+
+#include <dirent.h>
+#ifndef XREPLACE_NO_ZSTD
+#include <dlfcn.h>
+#endif
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <termios.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/quota.h>
+#include <sys/syscall.h>
+#include <zlib.h>
+#endif
+
+#ifdef XREPLACE_COUNT_ALLOCATIONS
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+// Build-time hook (make COUNT_ALLOCATIONS=1): count global heap allocations for --stats.
+// Every replaceable form is defined so each allocation is counted and freed by its pair
+static std::atomic<uint64_t> heap_allocations{0};
+
+static void *counted_allocate(std::size_t size, std::size_t alignment) noexcept
+{
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    size = size ? size : 1;
+    if (alignment <= alignof(std::max_align_t))
+    {
+        return std::malloc(size);
+    }
+    return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+// Out of line so the compiler doesn't pair a visible free with operator new
+[[gnu::noinline]] static void counted_free(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void *operator new(std::size_t size)
+{
+    if (void *ptr = counted_allocate(size, 0))
+    {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment)
+{
+    if (void *ptr = counted_allocate(size, static_cast<std::size_t>(alignment)))
+    {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment)
+{
+    return operator new(size, alignment);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+    return counted_allocate(size, 0);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+    return counted_allocate(size, 0);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    return counted_allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    return counted_allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void *ptr) noexcept
+{
+    counted_free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    counted_free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept
+{
+    counted_free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t) noexcept
+{
+    counted_free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept
+{
+    counted_free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept
+{
+    counted_free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept
+{
+    counted_free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept
+{
+    counted_free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+    counted_free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+    counted_free(ptr);
+}
+#endif
 
 // Alias
 using sv = std::string_view;
@@ -21,244 +191,5496 @@ enum Flags
     CONFIRM_EACH = 1 << 1,
     FROM_FILE = 1 << 2,
     FROM_DIR = 1 << 4,
+    STATS = 1 << 5,
+    SYNC = 1 << 6,
+    DEDUPE_EXISTING = 1 << 7,
+    PIN_CPUS = 1 << 8,
+    DRY_RUN = 1 << 9,
+    BROWSE = 1 << 10,
+    DECOMPRESS = 1 << 11,
 };
 
-// Print help and exit
-void help()
+// Counters collected per phase for --stats
+enum PerfCounter
 {
-    std::cout << R"(xreplace - batch file content replacer
-Usage:
-  xreplace [flags] --file <source_file> <destination_directory> <extension>
-  xreplace [flags] --dir  <source_directory> <destination_directory> <extension>
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CONTEXT_SWITCHES,
+    PERF_PAGE_FAULTS,
+    PERF_COUNT,
+};
 
-Arguments:
-  -f, --file <path>   Use a single file as the replacement source.
-  -d, --dir  <path>   Use all files  with the fitting extension in a directory
-                      as sources. Files will beassigned to targets in a fair, 
-                      even split.
+// Hardware and software counters of the calling thread and threads it spawns later
+class PerfCounters
+{
+public:
+    PerfCounters()
+    {
+        for (int &fd : fds)
+        {
+            fd = -1;
+        }
 
-  <destination_directory>
-                      Path to the folder containing files to be overwritten.
+#ifdef __linux__
+        const std::pair<uint32_t, uint64_t> events[PERF_COUNT] = {
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+            {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+        };
 
-  <extension>         Extension (with dot) of files to replace and read from.
-                      Example: .obj
+        for (int i = 0; i < PERF_COUNT; i++)
+        {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = events[i].first;
+            attr.config = events[i].second;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.inherit = 1;
 
-Flags:
-  -y, --yes           Skip the initial confirmation.
-  -a, --ask           Ask before overwriting each target file.
-  -h, --help          Show this help text and exit.
-  -v, --version       Show program version and exit.
+            // Context switches are only visible from the kernel side
+            if (i == PERF_CONTEXT_SWITCHES)
+            {
+                attr.exclude_kernel = 0;
+            }
 
-Behavior:
-  - In --file mode: the same source file is copied into every matching target.
-  - In --dir mode: target files are distributed evenly among the source files.
-    Example: 3 sources, 200 targets to 67, 67, and 66 targets each.
-  - Only files with the specified extension are replaced or read.
+            // Failure (perf_event_paranoid, missing PMU in VMs) leaves the counter disabled
+            fds[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        }
+#endif
+    }
 
-WARNING:
-  This program overwrites files permanently. There is no undo.
-)" << std::endl;
+    ~PerfCounters()
+    {
+#ifdef __linux__
+        for (int fd : fds)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+        }
+#endif
+    }
 
-    exit(0);
-}
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
 
-// Print version and exit
-void version()
+    bool available(int counter) const
+    {
+        return fds[counter] >= 0;
+    }
+
+    bool any_available() const
+    {
+        for (int fd : fds)
+        {
+            if (fd >= 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void read_all(uint64_t (&values)[PERF_COUNT]) const
+    {
+        for (int i = 0; i < PERF_COUNT; i++)
+        {
+            values[i] = 0;
+#ifdef __linux__
+            if (fds[i] >= 0 && ::read(fds[i], &values[i], sizeof(values[i])) != sizeof(values[i]))
+            {
+                values[i] = 0;
+            }
+#endif
+        }
+    }
+
+private:
+    int fds[PERF_COUNT];
+};
+
+#ifdef XREPLACE_COUNT_ALLOCATIONS
+constexpr bool COUNTING_ALLOCATIONS = true;
+#else
+constexpr bool COUNTING_ALLOCATIONS = false;
+#endif
+
+// Heap allocations so far, always 0 unless built with the counting hook
+uint64_t allocation_count()
 {
-    std::cout << "xreplace is running version " << VERSION_MAJOR << "." << VERSION_MINOR << "." << VERSION_PATCH << std::endl;
-    exit(0);
+#ifdef XREPLACE_COUNT_ALLOCATIONS
+    return heap_allocations.load(std::memory_order_relaxed);
+#else
+    return 0;
+#endif
 }
 
-// Check if arguments are sufficient and process them
-void handle_arguments(int argc, char **argv, std::string &source, std::string &dest_dir, std::string &extension, uint64_t &flags)
+// Timing and counters of one phase
+struct PhaseStats
 {
-    // Check argument count
-    if (argc < MIN_ARGC)
+    const char *name;
+    double seconds = 0;
+    uint64_t counters[PERF_COUNT] = {};
+    uint64_t allocations = 0;
+};
+
+// Upper bounds (seconds) of the per-file write latency histogram
+constexpr double LATENCY_BUCKETS[] = {0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+constexpr size_t LATENCY_BUCKET_COUNT = sizeof(LATENCY_BUCKETS) / sizeof(LATENCY_BUCKETS[0]);
+
+// Targets kept in the slowest list of --stats and --json
+constexpr size_t SLOWEST_COUNT = 10;
+
+// One entry of the slowest list
+struct SlowTarget
+{
+    double seconds;
+    uint64_t target; // index into plan.targets
+    uint64_t source; // index into plan.sources
+};
+
+// Write time of the targets assigned to one source
+struct SourceLatency
+{
+    uint64_t files = 0;
+    double seconds = 0;
+    double max_seconds = 0;
+};
+
+// Everything reported at the end of a run
+struct RunStats
+{
+    uint64_t scanned_files = 0;
+    uint64_t matched_files = 0;
+    uint64_t overwritten_files = 0;
+    uint64_t failed_files = 0;
+    uint64_t timed_out_files = 0;
+    uint64_t retried_files = 0;
+    uint64_t written_bytes = 0;
+    uint64_t collapsed_sources = 0;
+    uint64_t store_hits = 0;     // --store: sources taken from it unread
+    uint64_t stored_sources = 0; // objects it gained
+    uint64_t cloned_files = 0;
+    uint64_t deduped_files = 0;
+    uint64_t deduped_bytes = 0;
+    uint64_t changed_files = 0; // --dry-run
+    uint64_t changed_bytes = 0;
+    uint64_t unchanged_files = 0;
+    std::vector<PhaseStats> phases;
+    std::unique_ptr<PerfCounters> perf;
+
+    // Per-file write latency, the last bucket is +Inf
+    uint64_t latency_buckets[LATENCY_BUCKET_COUNT + 1] = {};
+    double latency_sum = 0;
+
+    // Min-heap on seconds, a new target only has to beat the fastest kept one
+    std::vector<SlowTarget> slowest;
+    std::vector<SourceLatency> source_latency; // indexed like plan.sources
+
+    // Outcome of one written target. Runs on the write loop's thread only
+    void record_target(uint64_t target, uint64_t source, double seconds)
     {
-        throw std::runtime_error("Unexpected argument count");
+        record_latency(seconds);
+
+        SourceLatency &per_source = source_latency[source];
+        per_source.files++;
+        per_source.seconds += seconds;
+        per_source.max_seconds = std::max(per_source.max_seconds, seconds);
+
+        auto faster = [](const SlowTarget &a, const SlowTarget &b) { return a.seconds > b.seconds; };
+        if (slowest.size() < SLOWEST_COUNT)
+        {
+            slowest.push_back({seconds, target, source});
+            std::push_heap(slowest.begin(), slowest.end(), faster);
+        }
+        else if (seconds > slowest.front().seconds)
+        {
+            std::pop_heap(slowest.begin(), slowest.end(), faster);
+            slowest.back() = {seconds, target, source};
+            std::push_heap(slowest.begin(), slowest.end(), faster);
+        }
     }
 
-    int beginning_position = 1;
+    void record_latency(double seconds)
+    {
+        size_t bucket = 0;
+        while (bucket < LATENCY_BUCKET_COUNT && seconds > LATENCY_BUCKETS[bucket])
+        {
+            bucket++;
+        }
+        latency_buckets[bucket]++;
+        latency_sum += seconds;
+    }
+};
 
-    // Process arguments
-    for (int i = 1; i < argc; i++)
+// Settings of flags that take a value
+struct Options
+{
+    std::string metrics_file;
+    std::string json_file;
+    std::string simulate;
+    std::string store_dir;
+    std::chrono::milliseconds target_timeout{0};
+    unsigned retries = 4;
+    size_t jobs = std::max(1u, std::thread::hardware_concurrency());
+    std::chrono::milliseconds deadline{0};
+    uint64_t max_bytes = 0;
+    uint64_t max_files = 0;
+    std::string cursor_file;
+    uint64_t max_mem = 0; // 0 picks a default from the cgroup limit
+    bool random_distribution = false;
+    std::optional<uint64_t> seed;
+    std::string targets_from;
+    std::string diff_file;
+    size_t pooled_fds = 16;  // read-only fds kept open between targets, set from RLIMIT_NOFILE
+    size_t held_fds = 256;   // target fds open at once in dedupe batches and hung writes
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now(); // --deadline counts from here
+
+    bool limited() const
     {
-        std::string_view arg = argv[i];
+        return deadline.count() > 0 || max_bytes > 0 || max_files > 0;
+    }
+};
 
-        if (arg == "-h" || arg == "--help")
+// Parse durations such as 500ms, 30s, 5m or 2h, plain numbers are seconds
+std::chrono::milliseconds parse_duration(sv text)
+{
+    size_t digits = 0;
+    while (digits < text.size() && text[digits] >= '0' && text[digits] <= '9')
+    {
+        digits++;
+    }
+    if (digits == 0 || digits > 12)
+    {
+        throw std::runtime_error("Invalid duration: " + std::string(text));
+    }
+
+    uint64_t value = std::stoull(std::string(text.substr(0, digits)));
+    sv unit = text.substr(digits);
+    if (unit == "ms")
+        return std::chrono::milliseconds(value);
+    if (unit.empty() || unit == "s")
+        return std::chrono::seconds(value);
+    if (unit == "m")
+        return std::chrono::minutes(value);
+    if (unit == "h")
+        return std::chrono::hours(value);
+
+    throw std::runtime_error("Invalid duration unit: " + std::string(text));
+}
+
+// Parse byte counts such as 4096, 512K, 20G or 1T, suffixes are powers of 1024
+uint64_t parse_size(sv text)
+{
+    size_t digits = 0;
+    while (digits < text.size() && text[digits] >= '0' && text[digits] <= '9')
+    {
+        digits++;
+    }
+    if (digits == 0 || digits > 15)
+    {
+        throw std::runtime_error("Invalid size: " + std::string(text));
+    }
+
+    uint64_t value = std::stoull(std::string(text.substr(0, digits)));
+    sv unit = text.substr(digits);
+    if (unit.empty())
+        return value;
+    if (unit == "K")
+        return value << 10;
+    if (unit == "M")
+        return value << 20;
+    if (unit == "G")
+        return value << 30;
+    if (unit == "T")
+        return value << 40;
+
+    throw std::runtime_error("Invalid size unit: " + std::string(text));
+}
+
+// Records the duration and counter deltas of a phase while in scope
+class PhaseScope
+{
+public:
+    PhaseScope(RunStats &stats, const char *name) : stats(stats), name(name)
+    {
+        if (stats.perf)
         {
-            help();
+            stats.perf->read_all(start_counters);
         }
-        else if (arg == "-v" || arg == "--version")
+        start_allocations = allocation_count();
+        start = std::chrono::steady_clock::now();
+    }
+
+    ~PhaseScope()
+    {
+        PhaseStats phase;
+        phase.name = name;
+        phase.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        phase.allocations = allocation_count() - start_allocations;
+
+        if (stats.perf)
         {
-            version();
+            uint64_t end_counters[PERF_COUNT];
+            stats.perf->read_all(end_counters);
+            for (int i = 0; i < PERF_COUNT; i++)
+            {
+                phase.counters[i] = end_counters[i] - start_counters[i];
+            }
         }
-        else if (arg == "-y" || arg == "--yes")
+
+        stats.phases.push_back(phase);
+    }
+
+    PhaseScope(const PhaseScope &) = delete;
+    PhaseScope &operator=(const PhaseScope &) = delete;
+
+private:
+    RunStats &stats;
+    const char *name;
+    std::chrono::steady_clock::time_point start;
+    uint64_t start_counters[PERF_COUNT] = {};
+    uint64_t start_allocations = 0;
+};
+
+// Memory shared by the plan, the source cache and I/O buffers (--max-mem).
+// Buffers and tables take what they need or fail the run cleanly, the cache
+// only takes what is left and gives it back when someone else runs short
+class MemoryBudget
+{
+public:
+    void set_limit(uint64_t bytes)
+    {
+        limit_bytes = bytes;
+    }
+
+    uint64_t limit() const
+    {
+        return limit_bytes;
+    }
+
+    uint64_t peak() const
+    {
+        return peak_bytes;
+    }
+
+    // Take bytes only if they fit with keep_free bytes to spare, never evicts
+    bool try_reserve(uint64_t bytes, uint64_t keep_free = 0)
+    {
+        uint64_t current = used_bytes.load();
+        do
         {
-            flags |= Flags::SKIP_CONFIRMATION;
-            beginning_position++;
-        }
-        else if (arg == "-a" || arg == "--ask")
+            if (current + bytes + keep_free > limit_bytes)
+            {
+                return false;
+            }
+        } while (!used_bytes.compare_exchange_weak(current, current + bytes));
+
+        uint64_t peak = peak_bytes.load();
+        while (current + bytes > peak && !peak_bytes.compare_exchange_weak(peak, current + bytes))
         {
-            flags |= Flags::CONFIRM_EACH;
-            beginning_position++;
         }
-        else if (arg == "-d" || arg == "--dir")
+        return true;
+    }
+
+    // Take bytes, evicting cached data first if they don't fit
+    void reserve(uint64_t bytes, const char *what)
+    {
+        while (!try_reserve(bytes))
         {
-            if (i == argc - 1 || argv[i + 1][0] == '-')
-                throw std::runtime_error("--dir requires path");
-            source = argv[i + 1];
-            flags |= Flags::FROM_DIR;
-            beginning_position += 2;
-            i++;
+            if (evict(bytes) == 0)
+            {
+                throw std::runtime_error("Memory budget of " + std::to_string(limit_bytes) + " bytes exceeded by " + what + ", raise --max-mem");
+            }
+        }
+    }
+
+    void release(uint64_t bytes)
+    {
+        used_bytes -= bytes;
+    }
+
+    // Frees at least the given bytes if it can and returns how many it freed.
+    // Calls are serialised with setting it, so the index thread can install and
+    // clear it while the browser or other threads reserve
+    void set_evictor(std::function<uint64_t(uint64_t)> function)
+    {
+        std::lock_guard<std::mutex> lock(evictor_mutex);
+        evictor = std::move(function);
+    }
+
+private:
+    uint64_t evict(uint64_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(evictor_mutex);
+        return evictor ? evictor(bytes) : 0;
+    }
+
+    uint64_t limit_bytes = UINT64_MAX;
+    std::atomic<uint64_t> used_bytes{0};
+    std::atomic<uint64_t> peak_bytes{0};
+    std::mutex evictor_mutex;
+    std::function<uint64_t(uint64_t)> evictor;
+};
+
+MemoryBudget memory_budget;
+
+// Half of the tightest memory.max on the way up our cgroup v2 path, or of
+// physical memory when no cgroup sets one
+uint64_t default_memory_limit()
+{
+    uint64_t limit = UINT64_MAX;
+
+    std::ifstream cgroup_file("/proc/self/cgroup");
+    std::string line;
+    while (std::getline(cgroup_file, line))
+    {
+        if (line.compare(0, 3, "0::") != 0)
+        {
+            continue;
+        }
+
+        std::string path = line.substr(3);
+        while (true)
+        {
+            std::ifstream max_file("/sys/fs/cgroup" + path + "/memory.max");
+            uint64_t value;
+            if (max_file >> value)
+            {
+                limit = std::min(limit, value);
+            }
+            if (path.empty() || path == "/")
+            {
+                break;
+            }
+            path.erase(path.rfind('/'));
+        }
+    }
+
+    if (limit == UINT64_MAX)
+    {
+        long pages = sysconf(_SC_PHYS_PAGES);
+        long page_size = sysconf(_SC_PAGE_SIZE);
+        if (pages > 0 && page_size > 0)
+        {
+            limit = static_cast<uint64_t>(pages) * static_cast<uint64_t>(page_size);
+        }
+    }
+
+    return limit == UINT64_MAX ? limit : limit / 2;
+}
+
+// I/O buffer size, one transparent huge page
+constexpr size_t SLAB_SIZE = 2 << 20;
+
+// Hugepage-aligned anonymous mapping charged to the memory budget. Pages are
+// placed on the NUMA node of the thread that first touches them, so every
+// worker maps its own (thread_slab) rather than taking one from a shared pool
+class Slab
+{
+public:
+    Slab()
+    {
+        memory_budget.reserve(SLAB_SIZE, "I/O buffers");
+
+        // Over-map and trim so the slab starts on a huge page boundary
+        void *mapping = mmap(nullptr, SLAB_SIZE * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED)
+        {
+            memory_budget.release(SLAB_SIZE);
+            throw std::system_error(errno, std::generic_category(), "Failed to map I/O buffer");
+        }
+        uintptr_t start = reinterpret_cast<uintptr_t>(mapping);
+        uintptr_t aligned = (start + SLAB_SIZE - 1) & ~static_cast<uintptr_t>(SLAB_SIZE - 1);
+        if (aligned > start)
+        {
+            munmap(mapping, aligned - start);
+        }
+        munmap(reinterpret_cast<void *>(aligned + SLAB_SIZE), start + SLAB_SIZE - aligned);
+        memory = reinterpret_cast<char *>(aligned);
+
+#ifdef MADV_HUGEPAGE
+        madvise(memory, SLAB_SIZE, MADV_HUGEPAGE);
+#endif
+    }
+
+    Slab(const Slab &) = delete;
+    Slab &operator=(const Slab &) = delete;
+
+    ~Slab()
+    {
+        munmap(memory, SLAB_SIZE);
+        memory_budget.release(SLAB_SIZE);
+    }
+
+    char *data()
+    {
+        return memory;
+    }
+
+    size_t size() const
+    {
+        return SLAB_SIZE;
+    }
+
+private:
+    char *memory = nullptr;
+};
+
+// The calling thread's I/O buffer, mapped on first use and unmapped when the thread exits
+Slab &thread_slab()
+{
+    thread_local Slab slab;
+    return slab;
+}
+
+// CPUs workers are pinned to with --pin-cpus, empty when not pinning
+std::vector<int> worker_cpus;
+
+// Remember the CPUs we may run on before any thread narrows its own mask
+void init_worker_cpus()
+{
+#ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        return;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &allowed))
+        {
+            worker_cpus.push_back(cpu);
+        }
+    }
+#endif
+}
+
+// Pin the calling thread to one CPU so it keeps running next to its slab
+void pin_worker(size_t worker)
+{
+#ifdef __linux__
+    if (worker_cpus.empty())
+    {
+        return;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(worker_cpus[worker % worker_cpus.size()], &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#else
+    (void)worker;
+#endif
+}
+
+// Paths packed back to back into one buffer, records are offsets into it.
+// Keeps the target table at one allocation per growth step instead of one per path
+class PathTable
+{
+public:
+    PathTable() = default;
+    PathTable(const PathTable &) = delete;
+    PathTable &operator=(const PathTable &) = delete;
+
+    PathTable(PathTable &&other) noexcept
+        : data(std::move(other.data)), offsets(std::move(other.offsets)), charged(other.charged)
+    {
+        other.charged = 0;
+    }
+
+    PathTable &operator=(PathTable &&other) noexcept
+    {
+        memory_budget.release(charged);
+        data = std::move(other.data);
+        offsets = std::move(other.offsets);
+        charged = other.charged;
+        other.charged = 0;
+        return *this;
+    }
+
+    ~PathTable()
+    {
+        memory_budget.release(charged);
+    }
+
+    void push_back(sv path)
+    {
+        // Grow explicitly so every growth step is charged to the memory budget
+        if (data.size() + path.size() + 1 > data.capacity())
+        {
+            size_t capacity = std::max(data.capacity() * 2, data.size() + path.size() + 1);
+            charge(capacity - data.capacity());
+            data.reserve(capacity);
+        }
+        if (offsets.size() == offsets.capacity())
+        {
+            size_t capacity = std::max<size_t>(offsets.capacity() * 2, 64);
+            charge((capacity - offsets.capacity()) * sizeof(uint64_t));
+            offsets.reserve(capacity);
+        }
+
+        offsets.push_back(data.size());
+        data.append(path);
+        data.push_back('\0');
+    }
+
+    const char *operator[](size_t index) const
+    {
+        return data.data() + offsets[index];
+    }
+
+    size_t size() const
+    {
+        return offsets.size();
+    }
+
+    bool empty() const
+    {
+        return offsets.empty();
+    }
+
+    // Byte order, so the same tree always gives the same plan
+    void sort()
+    {
+        std::sort(offsets.begin(), offsets.end(), [this](uint64_t a, uint64_t b) { return std::strcmp(data.data() + a, data.data() + b) < 0; });
+    }
+
+private:
+    void charge(uint64_t bytes)
+    {
+        memory_budget.reserve(bytes, "the file list");
+        charged += bytes;
+    }
+
+    std::string data;
+    std::vector<uint64_t> offsets;
+    uint64_t charged = 0;
+};
+
+// Keyed bijection of [0, count) for --distribute random: a balanced Feistel
+// network over the smallest even bit width covering count, walking the cycle
+// until the result is in range. Constant memory, any index can be mapped alone
+class Permutation
+{
+public:
+    Permutation(uint64_t count, uint64_t seed) : count(count)
+    {
+        unsigned bits = 2;
+        while (bits < 64 && (1ull << bits) < count)
+        {
+            bits += 2;
+        }
+        half_bits = bits / 2;
+        mask = (1ull << half_bits) - 1;
+
+        for (auto &key : keys)
+        {
+            seed += 0x9E3779B97F4A7C15ull;
+            key = mix(seed);
+        }
+    }
+
+    uint64_t operator()(uint64_t index) const
+    {
+        uint64_t value = index;
+        do
+        {
+            value = encrypt(value);
+        } while (value >= count);
+        return value;
+    }
+
+private:
+    // splitmix64 finalizer
+    static uint64_t mix(uint64_t value)
+    {
+        value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+        value = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+        return value ^ (value >> 31);
+    }
+
+    uint64_t encrypt(uint64_t value) const
+    {
+        uint64_t left = value >> half_bits;
+        uint64_t right = value & mask;
+        for (uint64_t key : keys)
+        {
+            uint64_t next = left ^ (mix(right ^ key) & mask);
+            left = right;
+            right = next;
+        }
+        return (left << half_bits) | right;
+    }
+
+    uint64_t count;
+    unsigned half_bits;
+    uint64_t mask;
+    uint64_t keys[4];
+};
+
+// Sources, targets and how they are paired
+struct Plan
+{
+    PathTable sources;
+    PathTable targets;
+    std::vector<uint64_t> source_sizes;
+    std::optional<Permutation> shuffle; // --distribute random
+    size_t assigned_targets = 0;        // targets the sources are split over, counted before --targets-from
+    uint64_t linked_targets = 0;        // reached through a symlink, possibly on another file system
+    std::vector<uint64_t> selected;     // --targets-from: scan position of each kept target, empty when all are kept
+};
+
+// Print help and exit
+void help()
+{
+    std::cout << R"(xreplace - batch file content replacer
+Usage:
+  xreplace [flags] --file <source_file> <destination_directory> <extension>
+  xreplace [flags] --store <dir> --file @<hash> <destination_directory> <extension>
+  xreplace [flags] --dir  <source_directory> <destination_directory> <extension>
+
+Arguments:
+  -f, --file <path>   Use a single file as the replacement source.
+  -d, --dir  <path>   Use all files  with the fitting extension in a directory
+                      as sources. Files will beassigned to targets in a fair, 
+                      even split.
+
+  <destination_directory>
+                      Path to the folder containing files to be overwritten.
+
+  <extension>         Extension (with dot) of files to replace and read from.
+                      Example: .obj
+
+Flags:
+  -y, --yes           Skip the initial confirmation.
+  -a, --ask           Ask before overwriting each target file.
+  --browse            Review the plan in the terminal before the run starts:
+                      page through every target and its source, list them by
+                      source, filter by path and exclude targets. Excluded
+                      targets keep the rest on their sources. Enter goes on to
+                      the usual confirmation, q quits without writing.
+  -s, --stats         Print per-phase timings and, where the kernel allows it,
+                      CPU cycles, instructions, context switches and page faults.
+  --metrics-file <path>
+                      Write counters, per-phase seconds and a per-file latency
+                      histogram in Prometheus text format when the run ends.
+                      The file is replaced atomically (node_exporter textfile
+                      collector).
+  --json <path>       Write the run's counters, phase times, latency histogram,
+                      slowest targets and write time per source as JSON when
+                      the run ends. The file is replaced atomically.
+  --fsync             Flush every target to disk before moving on.
+  --target-timeout <duration>
+                      Give up on a target that takes longer than this (500ms,
+                      30s, 5m), for hung FUSE or NFS mounts. The target is
+                      reported as timed out and the run continues.
+  -j, --jobs <count>  Targets written or compared at once, raise it for slow
+                      network or FUSE mounts. Default: number of CPUs.
+  --retries <count>   Attempts after a transient error (EBUSY, ETXTBSY, EAGAIN,
+                      EINTR, ESTALE), with jittered exponential backoff. Other
+                      targets are written while one waits. Default: 4.
+  --deadline <duration>
+                      Stop starting new targets once this much time has passed
+                      since launch (30m, 2h). Targets in progress are finished.
+  --max-bytes <size>  Stop starting new targets once this many bytes have been
+                      written (512M, 20G). At least one target is written.
+  --max-files <count> Stop starting new targets after this many.
+  --cursor <path>     Resume the plan from the position saved in this file and
+                      save where this run stopped, so a large replacement can
+                      be spread over several runs with the limits above. The
+                      file is rejected if the sources or targets have changed.
+  --max-mem <size>    Memory for the file list, source cache and buffers (2G).
+                      The cache gives memory back when the rest needs it, the
+                      run stops with an error if that is not enough. Default:
+                      half of the cgroup memory.max, or of physical memory.
+  --pin-cpus          Pin each hashing thread and the write loop to its own CPU.
+                      I/O buffers are first touched by the thread using them,
+                      so they stay on that CPU's NUMA node.
+  --distribute <blocks|random>
+                      How --dir sources are spread over targets. blocks gives
+                      each source a contiguous run of targets, random gives
+                      every target a random source. Both keep the counts fair.
+                      Default: blocks.
+  --seed <number>     Seed for --distribute random, the same seed gives the
+                      same assignment. Default: taken from --cursor, or picked
+                      at random and printed.
+  --dedupe-existing   Write nothing. Targets that already hold exactly the
+                      contents of their assigned source are made to share its
+                      extents (FIDEDUPERANGE, btrfs/XFS), freeing their blocks.
+  --decompress        Write the decompressed contents of gzip and zstd sources
+                      instead of copying them as they are.
+  --dry-run           Write nothing. Compare every target with its assigned
+                      source (size, then contents) and report how many would
+                      change, stay the same or could not be read, and how many
+                      bytes a run would write for the changed ones.
+  --diff <path>       With --dry-run, save the targets that would change to
+                      this file, one per line, ready for --targets-from.
+  --targets-from <path>
+                      Only use the targets named in this file, one per line.
+                      Each keeps the source it has in the full plan.
+  --store <dir>       Keep a copy of every source in this directory, named by
+                      its contents, and remember which source files it holds.
+                      Later runs skip reading and hashing sources that haven't
+                      changed and clone targets from the copy where the file
+                      system shares extents (keep it on the targets' file
+                      system for that). Stored sources can be named as
+                      --file @<hash>, any unique prefix of the hash will do.
+  --simulate <settings>
+                      Run against a generated in-memory tree instead of the
+                      disk, for benchmarking. Comma separated key=value list:
+                      files, sources, unique (distinct source contents),
+                      size and capacity (bytes), latency and jitter (us per
+                      operation), fail and busy (probability of EIO/EBUSY per
+                      operation), seed.
+                      Example: --simulate files=1000000,latency=50,fail=0.001
+  -h, --help          Show this help text and exit.
+  -v, --version       Show program version and exit.
+
+Behavior:
+  - In --file mode: the same source file is copied into every matching target.
+  - In --dir mode: target files are distributed evenly among the source files.
+    Example: 3 sources, 200 targets to 67, 67, and 66 targets each.
+    Sources with identical contents are read once, and on file systems with
+    shared extents (btrfs, XFS) targets are cloned from the first one written.
+  - Only files with the specified extension are replaced or read.
+  - Sources are copied byte for byte. With --decompress, sources compressed with
+    gzip or zstd (recognised by their first bytes) are decompressed once into
+    memory and written out from there. zstd needs libzstd.so.1 at run time,
+    static builds reject it. They count against --max-mem. With --store the
+    decompressed contents are stored, later runs write them straight from there.
+
+WARNING:
+  This program overwrites files permanently. There is no undo.
+)" << std::endl;
+
+    exit(0);
+}
+
+// Print version and exit
+void version()
+{
+    std::cout << "xreplace is running version " << VERSION_MAJOR << "." << VERSION_MINOR << "." << VERSION_PATCH << std::endl;
+    exit(0);
+}
+
+// Check if arguments are sufficient and process them
+void handle_arguments(int argc, char **argv, std::string &source, std::string &dest_dir, std::string &extension, uint64_t &flags, Options &options)
+{
+    // Check argument count
+    if (argc < MIN_ARGC)
+    {
+        throw std::runtime_error("Unexpected argument count");
+    }
+
+    int beginning_position = 1;
+
+    // Process arguments
+    for (int i = 1; i < argc; i++)
+    {
+        std::string_view arg = argv[i];
+
+        if (arg == "-h" || arg == "--help")
+        {
+            help();
+        }
+        else if (arg == "-v" || arg == "--version")
+        {
+            version();
+        }
+        else if (arg == "-y" || arg == "--yes")
+        {
+            flags |= Flags::SKIP_CONFIRMATION;
+            beginning_position++;
+        }
+        else if (arg == "-a" || arg == "--ask")
+        {
+            flags |= Flags::CONFIRM_EACH;
+            beginning_position++;
+        }
+        else if (arg == "-s" || arg == "--stats")
+        {
+            flags |= Flags::STATS;
+            beginning_position++;
+        }
+        else if (arg == "-d" || arg == "--dir")
+        {
+            if (i == argc - 1 || argv[i + 1][0] == '-')
+                throw std::runtime_error("--dir requires path");
+            source = argv[i + 1];
+            flags |= Flags::FROM_DIR;
+            beginning_position += 2;
+            i++;
+        }
+        else if (arg == "-f" || arg == "--file")
+        {
+            if (i == argc - 1 || argv[i + 1][0] == '-')
+                throw std::runtime_error("--file requires file");
+            source = argv[i + 1];
+            flags |= Flags::FROM_FILE;
+            beginning_position += 2;
+            i++;
+        }
+        else if (arg == "--fsync")
+        {
+            flags |= Flags::SYNC;
+            beginning_position++;
+        }
+        else if (arg == "--pin-cpus")
+        {
+            flags |= Flags::PIN_CPUS;
+            beginning_position++;
+        }
+        else if (arg == "--dedupe-existing")
+        {
+            flags |= Flags::DEDUPE_EXISTING;
+            beginning_position++;
+        }
+        else if (arg == "--browse")
+        {
+            flags |= Flags::BROWSE;
+            beginning_position++;
+        }
+        else if (arg == "--decompress")
+        {
+            flags |= Flags::DECOMPRESS;
+            beginning_position++;
+        }
+        else if (arg == "--dry-run")
+        {
+            flags |= Flags::DRY_RUN;
+            beginning_position++;
+        }
+        else if (arg == "--diff")
+        {
+            if (i == argc - 1 || argv[i + 1][0] == '-')
+                throw std::runtime_error("--diff requires path");
+            options.diff_file = argv[i + 1];
+            beginning_position += 2;
+            i++;
+        }
+        else if (arg == "--targets-from")
+        {
+            if (i == argc - 1 || argv[i + 1][0] == '-')
+                throw std::runtime_error("--targets-from requires path");
+            options.targets_from = argv[i + 1];
+            beginning_position += 2;
+            i++;
+        }
+        else if (arg == "--simulate")
+        {
+            if (i == argc - 1 || argv[i + 1][0] == '-')
+                throw std::runtime_error("--simulate requires settings");
+            options.simulate = argv[i + 1];
+            beginning_position += 2;
+            i++;
+        }
+        else if (arg == "--target-timeout")
+        {
+            if (i == argc - 1 || argv[i + 1][0] == '-')
+                throw std::runtime_error("--target-timeout requires duration");
+            options.target_timeout = parse_duration(argv[i + 1]);
+            beginning_position += 2;
+            i++;
+        }
+        else if (arg == "-j" || arg == "--jobs")
+        {
+            if (i == argc - 1 || argv[i + 1][0] == '-')
+                throw std::runtime_error("--jobs requires count");
+            try
+            {
+                options.jobs = static_cast<size_t>(std::stoul(argv[i + 1]));
+            }
+            catch (const std::logic_error &)
+            {
+                throw std::runtime_error("Invalid --jobs count: " + std::string(argv[i + 1]));
+            }
+            if (options.jobs == 0)
+            {
+                throw std::runtime_error("--jobs must be at least 1");
+            }
+            beginning_position += 2;
+            i++;
+        }
+        else if (arg == "--retries")
+        {
+            if (i == argc - 1 || argv[i + 1][0] == '-')
+                throw std::runtime_error("--retries requires count");
+            try
+            {
+                options.retries = static_cast<unsigned>(std::stoul(argv[i + 1]));
+            }
+            catch (const std::logic_error &)
+            {
+                throw std::runtime_error("Invalid --retries count: " + std::string(argv[i + 1]));
+            }
+            beginning_position += 2;
+            i++;
+        }
+        else if (arg == "--deadline")
+        {
+            if (i == argc - 1 || argv[i + 1][0] == '-')
+                throw std::runtime_error("--deadline requires duration");
+            options.deadline = parse_duration(argv[i + 1]);
+            beginning_position += 2;
+            i++;
+        }
+        else if (arg == "--max-bytes")
+        {
+            if (i == argc - 1 || argv[i + 1][0] == '-')
+                throw std::runtime_error("--max-bytes requires size");
+            options.max_bytes = parse_size(argv[i + 1]);
+            beginning_position += 2;
+            i++;
+        }
+        else if (arg == "--max-files")
+        {
+            if (i == argc - 1 || argv[i + 1][0] == '-')
+                throw std::runtime_error("--max-files requires count");
+            options.max_files = parse_size(argv[i + 1]);
+            beginning_position += 2;
+            i++;
+        }
+        else if (arg == "--cursor")
+        {
+            if (i == argc - 1 || argv[i + 1][0] == '-')
+                throw std::runtime_error("--cursor requires path");
+            options.cursor_file = argv[i + 1];
+            beginning_position += 2;
+            i++;
+        }
+        else if (arg == "--max-mem")
+        {
+            if (i == argc - 1 || argv[i + 1][0] == '-')
+                throw std::runtime_error("--max-mem requires size");
+            options.max_mem = parse_size(argv[i + 1]);
+            beginning_position += 2;
+            i++;
+        }
+        else if (arg == "--distribute")
+        {
+            if (i == argc - 1 || argv[i + 1][0] == '-')
+                throw std::runtime_error("--distribute requires blocks or random");
+            sv mode = argv[i + 1];
+            if (mode != "blocks" && mode != "random")
+                throw std::runtime_error("Invalid --distribute mode: " + std::string(mode));
+            options.random_distribution = mode == "random";
+            beginning_position += 2;
+            i++;
+        }
+        else if (arg == "--seed")
+        {
+            if (i == argc - 1 || argv[i + 1][0] == '-')
+                throw std::runtime_error("--seed requires number");
+            try
+            {
+                options.seed = std::stoull(argv[i + 1]);
+            }
+            catch (const std::logic_error &)
+            {
+                throw std::runtime_error("Invalid --seed: " + std::string(argv[i + 1]));
+            }
+            beginning_position += 2;
+            i++;
+        }
+        else if (arg == "--store")
+        {
+            if (i == argc - 1 || argv[i + 1][0] == '-')
+                throw std::runtime_error("--store requires directory");
+            options.store_dir = argv[i + 1];
+            beginning_position += 2;
+            i++;
+        }
+        else if (arg == "--json")
+        {
+            if (i == argc - 1 || argv[i + 1][0] == '-')
+                throw std::runtime_error("--json requires path");
+            options.json_file = argv[i + 1];
+            beginning_position += 2;
+            i++;
+        }
+        else if (arg == "--metrics-file")
+        {
+            if (i == argc - 1 || argv[i + 1][0] == '-')
+                throw std::runtime_error("--metrics-file requires path");
+            options.metrics_file = argv[i + 1];
+            beginning_position += 2;
+            i++;
+        }
+        else if (arg.at(0) == '-')
+        {
+            throw std::runtime_error("Unknown argument: " + std::string(arg));
+        }
+    }
+
+    if (argc != beginning_position + 2)
+    {
+        throw std::runtime_error("Unfulfilled arguments");
+    }
+
+    dest_dir = argv[beginning_position];
+    extension = argv[beginning_position + 1];
+}
+
+// Result of looking up a path
+struct FileStatus
+{
+    bool exists = false;
+    bool is_directory = false;
+    bool is_regular = false;
+    uint64_t size = 0;
+    uint64_t device = 0;
+};
+
+// Source file kept open while consecutive targets are written from it
+struct SourceHandle
+{
+    int fd = -1;
+    uint64_t size = 0;
+    const char *path = nullptr;
+};
+
+// File system operations used by the scanner and the copy loop. Errors are
+// reported as std::system_error carrying the errno of the failed operation
+class Backend
+{
+public:
+    virtual ~Backend() = default;
+
+    // Collect regular files with matching extension, returns the number of entries looked at.
+    // links counts the collected files that may be symlinks (d_type DT_LNK or DT_UNKNOWN)
+    virtual uint64_t scan(const char *dir, sv extension, PathTable &files, uint64_t &links) = 0;
+    virtual FileStatus stat(const char *path) = 0;
+    virtual SourceHandle open_source(const char *path) = 0;
+    // Open a target for reading without truncating it, writable where permitted
+    virtual SourceHandle open_existing(const char *path) = 0;
+    virtual int open_target(const char *path) = 0;
+    // Replace the contents of dst_fd with the source, returns bytes written
+    virtual uint64_t copy(const SourceHandle &src, int dst_fd, const char *dest_file) = 0;
+    // Read up to length bytes at offset, returns bytes read (0 at end of file)
+    virtual uint64_t read(const SourceHandle &src, void *buffer, uint64_t length, uint64_t offset) = 0;
+    virtual void write(int dst_fd, const void *buffer, uint64_t length, const char *dest_file) = 0;
+    // Share the extents of src_fd with dst_fd, false where the file system can't
+    virtual bool clone(int src_fd, int dst_fd, const char *dest_file) = 0;
+    // Let targets share the source's extents where their contents are equal,
+    // sets deduped[i] for every target the file system deduplicated
+    virtual void dedupe(const SourceHandle &src, const int *dst_fds, size_t count, bool *deduped) = 0;
+    virtual void sync(int fd, const char *path) = 0;
+    virtual void close(int fd) = 0;
+    // Bytes the current user may still write on the file system holding path,
+    // the smaller of free space and remaining quota
+    virtual uint64_t available_space(const char *path) = 0;
+};
+
+[[noreturn]] void throw_errno(const char *what, sv path)
+{
+    int error = errno;
+    throw std::system_error(error, std::generic_category(), what + std::string(path));
+}
+
+// Extension as std::filesystem::path::extension defines it: from the last dot,
+// empty for names without one and for dotfiles
+sv extension_of(sv filename)
+{
+    size_t dot = filename.find_last_of('.');
+    if (dot == sv::npos || dot == 0 || filename == "..")
+    {
+        return sv();
+    }
+    return filename.substr(dot);
+}
+
+// The real file system
+class PosixBackend final : public Backend
+{
+public:
+    uint64_t scan(const char *dir, sv extension, PathTable &files, uint64_t &links) override
+    {
+        DIR *handle = opendir(dir);
+        if (!handle)
+        {
+            throw_errno("Failed to open directory: ", dir);
+        }
+
+        std::string path(dir);
+        if (path.back() != '/')
+        {
+            path.push_back('/');
+        }
+        size_t base_length = path.size();
+
+        uint64_t scanned = 0;
+        while (dirent *entry = readdir(handle))
+        {
+            sv name = entry->d_name;
+            if (name == "." || name == "..")
+            {
+                continue;
+            }
+
+            scanned++;
+            if (extension_of(name) != extension)
+            {
+                continue;
+            }
+
+            path.resize(base_length);
+            path.append(name);
+
+            // Symlinks count as the file they point to, like directory_entry::is_regular_file
+            bool regular = entry->d_type == DT_REG;
+            if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN)
+            {
+                struct stat st;
+                regular = ::stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+            }
+
+            if (regular)
+            {
+                files.push_back(path);
+                links += entry->d_type != DT_REG;
+            }
+        }
+
+        closedir(handle);
+        return scanned;
+    }
+
+    FileStatus stat(const char *path) override
+    {
+        FileStatus status;
+        struct stat st;
+        if (::stat(path, &st) == 0)
+        {
+            status.exists = true;
+            status.is_directory = S_ISDIR(st.st_mode);
+            status.is_regular = S_ISREG(st.st_mode);
+            status.size = static_cast<uint64_t>(st.st_size);
+            status.device = static_cast<uint64_t>(st.st_dev);
+        }
+        return status;
+    }
+
+    SourceHandle open_source(const char *path) override
+    {
+        SourceHandle handle;
+        handle.fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (handle.fd < 0)
+        {
+            throw_errno("Failed to open source file: ", path);
+        }
+
+        struct stat st;
+        if (fstat(handle.fd, &st) != 0)
+        {
+            ::close(handle.fd);
+            throw_errno("Failed to stat source file: ", path);
+        }
+        handle.size = static_cast<uint64_t>(st.st_size);
+        handle.path = path;
+        return handle;
+    }
+
+    SourceHandle open_existing(const char *path) override
+    {
+        // Read-only fds work for FIDEDUPERANGE as long as we own the file
+        int fd = open(path, O_RDWR | O_CLOEXEC);
+        if (fd < 0 && errno == EACCES)
+        {
+            fd = open(path, O_RDONLY | O_CLOEXEC);
+        }
+        if (fd < 0)
+        {
+            throw_errno("Failed to open destination file: ", path);
+        }
+
+        SourceHandle handle;
+        handle.fd = fd;
+        handle.path = path;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            ::close(fd);
+            throw_errno("Failed to stat destination file: ", path);
+        }
+        handle.size = static_cast<uint64_t>(st.st_size);
+        return handle;
+    }
+
+    int open_target(const char *path) override
+    {
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd < 0)
+        {
+            throw_errno("Failed to open destination file: ", path);
+        }
+        return fd;
+    }
+
+    // Costs a single copy_file_range for most files
+    uint64_t copy(const SourceHandle &src, int dst_fd, const char *dest_file) override
+    {
+        // Offsets are explicit so the shared source fd never seeks
+        off_t offset = 0;
+#ifdef __linux__
+        while (static_cast<uint64_t>(offset) < src.size)
+        {
+            ssize_t n = copy_file_range(src.fd, &offset, dst_fd, nullptr, src.size - offset, 0);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+            {
+                break;
+            }
+            if (n < 0)
+            {
+                throw_errno("Failed to write destination file: ", dest_file);
+            }
+            if (n == 0)
+            {
+                break;
+            }
+        }
+#endif
+
+        // Copy with read/write where the kernel can't copy between the files directly
+        char *buffer = nullptr;
+        while (static_cast<uint64_t>(offset) < src.size)
+        {
+            if (!buffer)
+            {
+                buffer = thread_slab().data();
+            }
+            ssize_t n = pread(src.fd, buffer, std::min<uint64_t>(SLAB_SIZE, src.size - offset), offset);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n < 0)
+            {
+                throw_errno("Failed to read source file: ", src.path ? src.path : "");
+            }
+            // The source shrank since it was opened, the target would be cut short
+            if (n == 0)
+            {
+                throw std::system_error(EIO, std::generic_category(), "Source file ended early: " + std::string(src.path ? src.path : ""));
+            }
+            for (ssize_t written = 0; written < n;)
+            {
+                ssize_t w = ::write(dst_fd, buffer + written, n - written);
+                if (w < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (w < 0)
+                {
+                    throw_errno("Failed to write destination file: ", dest_file);
+                }
+                written += w;
+            }
+            offset += n;
+        }
+
+        return static_cast<uint64_t>(offset);
+    }
+
+    uint64_t read(const SourceHandle &src, void *buffer, uint64_t length, uint64_t offset) override
+    {
+        ssize_t n;
+        do
+        {
+            n = pread(src.fd, buffer, length, static_cast<off_t>(offset));
+        } while (n < 0 && errno == EINTR);
+
+        if (n < 0)
+        {
+            throw_errno("Failed to read source file: ", src.path ? src.path : "");
+        }
+        return static_cast<uint64_t>(n);
+    }
+
+    void write(int dst_fd, const void *buffer, uint64_t length, const char *dest_file) override
+    {
+        const char *data = static_cast<const char *>(buffer);
+        while (length > 0)
+        {
+            ssize_t n = ::write(dst_fd, data, length);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n < 0)
+            {
+                throw_errno("Failed to write destination file: ", dest_file);
+            }
+            data += n;
+            length -= static_cast<uint64_t>(n);
+        }
+    }
+
+    bool clone(int src_fd, int dst_fd, const char *dest_file) override
+    {
+#ifdef FICLONE
+        if (ioctl(dst_fd, FICLONE, src_fd) == 0)
+        {
+            return true;
+        }
+        if (errno != EOPNOTSUPP && errno != ENOTTY && errno != EXDEV && errno != EINVAL && errno != ENOSYS)
+        {
+            throw_errno("Failed to clone into destination file: ", dest_file);
+        }
+#endif
+        return false;
+    }
+
+    // FIDEDUPERANGE compares the bytes itself and may dedupe less than asked for per call,
+    // so ranges are submitted repeatedly from the smallest offset every target reached
+    void dedupe(const SourceHandle &src, const int *dst_fds, size_t count, bool *deduped) override
+    {
+#ifdef FIDEDUPERANGE
+        std::vector<size_t> active;
+        for (size_t i = 0; i < count; i++)
+        {
+            deduped[i] = src.size > 0;
+            if (deduped[i])
+            {
+                active.push_back(i);
+            }
+        }
+
+        std::vector<unsigned char> storage(sizeof(file_dedupe_range) + count * sizeof(file_dedupe_range_info));
+        auto *range = reinterpret_cast<file_dedupe_range *>(storage.data());
+
+        uint64_t offset = 0;
+        while (offset < src.size && !active.empty())
+        {
+            std::fill(storage.begin(), storage.end(), 0);
+            range->src_offset = offset;
+            range->src_length = src.size - offset;
+            range->dest_count = static_cast<uint16_t>(active.size());
+            for (size_t i = 0; i < active.size(); i++)
+            {
+                range->info[i].dest_fd = dst_fds[active[i]];
+                range->info[i].dest_offset = offset;
+            }
+
+            if (ioctl(src.fd, FIDEDUPERANGE, range) != 0)
+            {
+                throw_errno("Failed to deduplicate against source file: ", src.path ? src.path : "");
+            }
+
+            uint64_t step = src.size - offset;
+            std::vector<size_t> still_active;
+            for (size_t i = 0; i < active.size(); i++)
+            {
+                const auto &info = range->info[i];
+                if (info.status != FILE_DEDUPE_RANGE_SAME || info.bytes_deduped == 0)
+                {
+                    deduped[active[i]] = false;
+                    continue;
+                }
+                step = std::min<uint64_t>(step, info.bytes_deduped);
+                still_active.push_back(active[i]);
+            }
+
+            active.swap(still_active);
+            offset += step;
+        }
+#else
+        (void)dst_fds;
+        std::fill(deduped, deduped + count, false);
+        errno = EOPNOTSUPP;
+        throw_errno("Failed to deduplicate against source file: ", src.path ? src.path : "");
+#endif
+    }
+
+    void sync(int fd, const char *path) override
+    {
+        if (fsync(fd) != 0)
+        {
+            throw_errno("Failed to sync destination file: ", path);
+        }
+    }
+
+    void close(int fd) override
+    {
+        ::close(fd);
+    }
+
+    uint64_t available_space(const char *path) override
+    {
+        struct statvfs fs;
+        if (statvfs(path, &fs) != 0)
+        {
+            throw_errno("Failed to query free space of: ", path);
+        }
+        uint64_t available = static_cast<uint64_t>(fs.f_bavail) * fs.f_frsize;
+
+        // quotactl_fd needs no block device path, file systems without quotas just fail the call
+#if defined(__linux__) && defined(SYS_quotactl_fd)
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0)
+        {
+            dqblk quota;
+            std::memset(&quota, 0, sizeof(quota));
+            if (syscall(SYS_quotactl_fd, fd, QCMD(Q_GETQUOTA, USRQUOTA), getuid(), &quota) == 0 && (quota.dqb_valid & QIF_BLIMITS) && quota.dqb_bhardlimit > 0)
+            {
+                uint64_t limit = quota.dqb_bhardlimit * 1024;
+                available = std::min(available, limit > quota.dqb_curspace ? limit - quota.dqb_curspace : 0);
+            }
+            ::close(fd);
+        }
+#endif
+        return available;
+    }
+};
+
+// Parameters of the in-memory backend, parsed from --simulate
+struct SimulationSpec
+{
+    uint64_t targets = 1000;
+    uint64_t sources = 3;
+    uint64_t unique_sources = 0; // distinct source contents, 0 for all distinct
+    uint64_t size = 4096;
+    uint64_t capacity = 0; // bytes the simulated file system holds, 0 for unlimited
+    uint64_t latency_us = 0;
+    uint64_t jitter_us = 0;
+    double failure_rate = 0;
+    double busy_rate = 0; // transient EBUSY failures
+    uint64_t seed = 1;
+};
+
+SimulationSpec parse_simulation_spec(sv spec)
+{
+    SimulationSpec result;
+
+    while (!spec.empty())
+    {
+        size_t comma = spec.find(',');
+        sv item = spec.substr(0, comma);
+        spec = comma == sv::npos ? sv() : spec.substr(comma + 1);
+
+        size_t equals = item.find('=');
+        if (equals == sv::npos)
+        {
+            throw std::runtime_error("Invalid --simulate setting: " + std::string(item));
+        }
+        sv key = item.substr(0, equals);
+        std::string value(item.substr(equals + 1));
+
+        try
+        {
+            if (key == "files")
+                result.targets = std::stoull(value);
+            else if (key == "sources")
+                result.sources = std::stoull(value);
+            else if (key == "unique")
+                result.unique_sources = std::stoull(value);
+            else if (key == "size")
+                result.size = std::stoull(value);
+            else if (key == "capacity")
+                result.capacity = std::stoull(value);
+            else if (key == "latency")
+                result.latency_us = std::stoull(value);
+            else if (key == "jitter")
+                result.jitter_us = std::stoull(value);
+            else if (key == "fail")
+                result.failure_rate = std::stod(value);
+            else if (key == "busy")
+                result.busy_rate = std::stod(value);
+            else if (key == "seed")
+                result.seed = std::stoull(value);
+            else
+                throw std::runtime_error("Unknown --simulate setting: " + std::string(key));
+        }
+        catch (const std::logic_error &)
+        {
+            throw std::runtime_error("Invalid --simulate value: " + std::string(item));
+        }
+    }
+
+    if (result.sources == 0)
+    {
+        throw std::runtime_error("--simulate needs at least one source");
+    }
+    return result;
+}
+
+// Generated in-memory tree with configurable per-operation latency, jitter and
+// failure injection, for exercising the planner and copy loop without real disks.
+// Directories hold files named f<index><extension>, only sizes and a content id are stored
+class MemoryBackend final : public Backend
+{
+public:
+    MemoryBackend(const SimulationSpec &spec, sv source, sv dest_dir, sv extension, const uint64_t flags) : spec(spec), rng(spec.seed)
+    {
+        if (flags & Flags::FROM_DIR)
+        {
+            add_directory(source, extension, spec.sources, spec.size, 0, spec.unique_sources ? spec.unique_sources : spec.sources);
+        }
+        else
+        {
+            single_source_path = source;
+            single_source = {spec.size, 0};
+        }
+        add_directory(dest_dir, extension, spec.targets, spec.size / 2, spec.sources, spec.targets);
+    }
+
+    // The simulated file system has no links
+    uint64_t scan(const char *dir, sv extension, PathTable &files, uint64_t &) override
+    {
+        simulate_operation("Failed to open directory: ", dir);
+
+        for (const auto &directory : directories)
+        {
+            if (directory.path == dir && directory.extension == extension)
+            {
+                std::string path;
+                for (size_t i = 0; i < directory.files.size(); i++)
+                {
+                    format_path(directory, i, path);
+                    files.push_back(path);
+                }
+                return directory.files.size();
+            }
+        }
+        return 0;
+    }
+
+    FileStatus stat(const char *path) override
+    {
+        FileStatus status;
+        for (const auto &directory : directories)
+        {
+            if (directory.path == path)
+            {
+                status.exists = true;
+                status.is_directory = true;
+                return status;
+            }
+        }
+
+        if (SimFile *file = lookup(path))
+        {
+            status.exists = true;
+            status.is_regular = true;
+            status.size = file->size;
+        }
+        status.device = 1;
+        return status;
+    }
+
+    SourceHandle open_source(const char *path) override
+    {
+        simulate_operation("Failed to open source file: ", path);
+
+        SimFile *file = lookup(path);
+        if (!file)
+        {
+            errno = ENOENT;
+            throw_errno("Failed to open source file: ", path);
+        }
+
+        SourceHandle handle;
+        handle.fd = allocate_handle(file);
+        handle.size = file->size;
+        handle.path = path;
+        return handle;
+    }
+
+    SourceHandle open_existing(const char *path) override
+    {
+        return open_source(path);
+    }
+
+    int open_target(const char *path) override
+    {
+        simulate_operation("Failed to open destination file: ", path);
+
+        SimFile *file = lookup(path);
+        if (!file)
+        {
+            errno = ENOENT;
+            throw_errno("Failed to open destination file: ", path);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        file->size = 0;
+        return allocate_handle_locked(file);
+    }
+
+    uint64_t copy(const SourceHandle &src, int dst_fd, const char *dest_file) override
+    {
+        simulate_operation("Failed to write destination file: ", dest_file);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        *handles[dst_fd] = *handles[src.fd];
+        return src.size;
+    }
+
+    // File bytes are generated: the first 8 hold the content id, the rest a pattern derived from it
+    uint64_t read(const SourceHandle &src, void *buffer, uint64_t length, uint64_t offset) override
+    {
+        simulate_operation("Failed to read source file: ", src.path ? src.path : "");
+
+        SimFile file;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            file = *handles[src.fd];
+        }
+
+        if (offset >= file.size)
+        {
+            return 0;
+        }
+        length = std::min(length, file.size - offset);
+
+        unsigned char *bytes = static_cast<unsigned char *>(buffer);
+        for (uint64_t i = 0; i < length; i++)
+        {
+            uint64_t position = offset + i;
+            bytes[i] = position < 8 ? static_cast<unsigned char>(file.content >> (position * 8)) : static_cast<unsigned char>(file.content * 131 + position);
+        }
+        return length;
+    }
+
+    void write(int dst_fd, const void *buffer, uint64_t length, const char *dest_file) override
+    {
+        simulate_operation("Failed to write destination file: ", dest_file);
+
+        uint64_t content = 0;
+        std::memcpy(&content, buffer, std::min<uint64_t>(length, sizeof(content)));
+
+        std::lock_guard<std::mutex> lock(mutex);
+        *handles[dst_fd] = {length, content};
+    }
+
+    // Every simulated file system supports shared extents
+    bool clone(int src_fd, int dst_fd, const char *dest_file) override
+    {
+        simulate_operation("Failed to clone into destination file: ", dest_file);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        *handles[dst_fd] = *handles[src_fd];
+        return true;
+    }
+
+    void dedupe(const SourceHandle &src, const int *dst_fds, size_t count, bool *deduped) override
+    {
+        simulate_operation("Failed to deduplicate against source file: ", src.path ? src.path : "");
+
+        std::lock_guard<std::mutex> lock(mutex);
+        const SimFile &source = *handles[src.fd];
+        for (size_t i = 0; i < count; i++)
+        {
+            const SimFile &target = *handles[dst_fds[i]];
+            deduped[i] = source.size > 0 && target.size == source.size && target.content == source.content;
+        }
+    }
+
+    void sync(int, const char *path) override
+    {
+        simulate_operation("Failed to sync destination file: ", path);
+    }
+
+    void close(int fd) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        handles[fd] = nullptr;
+        free_handles.push_back(fd);
+    }
+
+    uint64_t available_space(const char *) override
+    {
+        if (spec.capacity == 0)
+        {
+            return UINT64_MAX;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t used = single_source.size;
+        for (const auto &directory : directories)
+        {
+            for (const auto &file : directory.files)
+            {
+                used += file.size;
+            }
+        }
+        return used < spec.capacity ? spec.capacity - used : 0;
+    }
+
+private:
+    struct SimFile
+    {
+        uint64_t size;
+        uint64_t content;
+    };
+
+    struct SimDirectory
+    {
+        std::string path;
+        std::string extension;
+        int digits;
+        std::vector<SimFile> files;
+    };
+
+    void add_directory(sv path, sv extension, uint64_t count, uint64_t size, uint64_t first_content, uint64_t distinct)
+    {
+        SimDirectory directory;
+        directory.path = path;
+        directory.extension = extension;
+        directory.digits = static_cast<int>(std::to_string(count).size());
+        directory.files.resize(count);
+        for (uint64_t i = 0; i < count; i++)
+        {
+            directory.files[i] = {size, first_content + i % distinct};
+        }
+        directories.push_back(std::move(directory));
+    }
+
+    static void format_path(const SimDirectory &directory, size_t index, std::string &path)
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "/f%0*zu", directory.digits, index);
+        path.assign(directory.path);
+        path.append(name);
+        path.append(directory.extension);
+    }
+
+    SimFile *lookup(sv path)
+    {
+        if (!single_source_path.empty() && path == single_source_path)
+        {
+            return &single_source;
+        }
+
+        for (auto &directory : directories)
+        {
+            sv prefix = directory.path;
+            if (path.size() <= prefix.size() + 2 + directory.extension.size() || path.substr(0, prefix.size()) != prefix || path.substr(prefix.size(), 2) != "/f")
+            {
+                continue;
+            }
+
+            sv digits = path.substr(prefix.size() + 2, path.size() - prefix.size() - 2 - directory.extension.size());
+            if (path.substr(path.size() - directory.extension.size()) != directory.extension || digits.size() != static_cast<size_t>(directory.digits))
+            {
+                continue;
+            }
+
+            size_t index = 0;
+            for (char c : digits)
+            {
+                if (c < '0' || c > '9')
+                {
+                    return nullptr;
+                }
+                index = index * 10 + (c - '0');
+            }
+            return index < directory.files.size() ? &directory.files[index] : nullptr;
+        }
+        return nullptr;
+    }
+
+    int allocate_handle(SimFile *file)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return allocate_handle_locked(file);
+    }
+
+    int allocate_handle_locked(SimFile *file)
+    {
+        if (!free_handles.empty())
+        {
+            int fd = free_handles.back();
+            free_handles.pop_back();
+            handles[fd] = file;
+            return fd;
+        }
+        handles.push_back(file);
+        return static_cast<int>(handles.size() - 1);
+    }
+
+    // Sleep for the configured latency plus jitter, then maybe fail with EIO or EBUSY
+    void simulate_operation(const char *what, sv path)
+    {
+        uint64_t delay_us = spec.latency_us;
+        bool fail = false;
+        bool busy = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (spec.jitter_us > 0)
+            {
+                delay_us += std::uniform_int_distribution<uint64_t>(0, spec.jitter_us)(rng);
+            }
+            fail = spec.failure_rate > 0 && std::uniform_real_distribution<double>(0, 1)(rng) < spec.failure_rate;
+            busy = spec.busy_rate > 0 && std::uniform_real_distribution<double>(0, 1)(rng) < spec.busy_rate;
+        }
+
+        if (delay_us > 0)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(delay_us));
+        }
+        if (fail || busy)
+        {
+            errno = fail ? EIO : EBUSY;
+            throw_errno(what, path);
+        }
+    }
+
+    SimulationSpec spec;
+    std::mt19937_64 rng;
+    std::mutex mutex;
+    std::vector<SimDirectory> directories;
+    std::string single_source_path;
+    SimFile single_source{};
+    std::vector<SimFile *> handles;
+    std::vector<int> free_handles;
+};
+
+// Signal number of the first SIGINT/SIGTERM, 0 while the run may go on
+std::atomic<int> cancel_signal{0};
+static_assert(std::atomic<int>::is_always_lock_free, "cancel_signal is written from a signal handler");
+
+extern "C" void handle_cancel_signal(int signo)
+{
+    if (cancel_signal.exchange(signo) != 0)
+    {
+        const char message[] = "\nINFO: Forced exit\n";
+        (void)!write(STDERR_FILENO, message, sizeof(message) - 1);
+        _exit(128 + signo);
+    }
+
+    const char message[] = "\nINFO: Stopping after the current file, send the signal again to force exit\n";
+    (void)!write(STDERR_FILENO, message, sizeof(message) - 1);
+}
+
+// The first signal stops dispatching new targets, the file being written is finished
+// and the partial summary printed. SA_RESTART is left out so a waiting prompt returns
+void install_signal_handlers()
+{
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_cancel_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+}
+
+bool cancel_requested()
+{
+    return cancel_signal.load(std::memory_order_relaxed) != 0;
+}
+
+// Prompt user for confirmation
+void confirm_overwrite()
+{
+    std::cout << "Continue? (y/n): ";
+
+    std::string response;
+    std::getline(std::cin, response);
+
+    // An interrupted prompt is answered by the caller checking cancel_requested()
+    if (cancel_requested())
+    {
+        std::cin.clear();
+        return;
+    }
+
+    if (response.empty() || (response.at(0) != 'y' && response.at(0) != 'Y'))
+    {
+        exit(1);
+    }
+}
+
+// Last component of a path, without allocating
+sv filename_of(sv path)
+{
+    size_t slash = path.find_last_of('/');
+    return slash == sv::npos ? path : path.substr(slash + 1);
+}
+
+// Scan source and destination and decide what gets written where. A --file
+// source was already looked up by validate_arguments
+Plan build_plan(Backend &backend, const std::string &source, const FileStatus &source_status, const std::string &dest_dir, sv extension, RunStats &stats, const uint64_t flags)
+{
+    Plan plan;
+
+    if (flags & Flags::FROM_DIR)
+    {
+        uint64_t links = 0;
+        stats.scanned_files += backend.scan(source.c_str(), extension, plan.sources, links);
+    }
+    else
+    {
+        plan.sources.push_back(source);
+    }
+
+    stats.scanned_files += backend.scan(dest_dir.c_str(), extension, plan.targets, plan.linked_targets);
+    stats.matched_files = plan.targets.size();
+    plan.assigned_targets = plan.targets.size();
+
+    // Directory order is arbitrary, a cursor needs the plan to come out the same every run
+    plan.sources.sort();
+    plan.targets.sort();
+
+    if (plan.sources.empty())
+    {
+        throw std::runtime_error("No source files found with the given extension");
+    }
+    if (plan.targets.empty())
+    {
+        throw std::runtime_error("No destination files found with the given extension");
+    }
+
+    plan.source_sizes.reserve(plan.sources.size());
+    if (!(flags & Flags::FROM_DIR))
+    {
+        plan.source_sizes.push_back(source_status.size);
+    }
+    for (size_t i = plan.source_sizes.size(); i < plan.sources.size(); i++)
+    {
+        plan.source_sizes.push_back(backend.stat(plan.sources[i]).size);
+    }
+
+    return plan;
+}
+
+// Drop the targets not marked in keep. The rest stay on the sources they have
+// in the full plan, see source_index_for
+void keep_targets(Plan &plan, const std::vector<bool> &keep)
+{
+    PathTable kept;
+    std::vector<uint64_t> selected;
+    for (size_t i = 0; i < plan.targets.size(); i++)
+    {
+        if (keep[i])
+        {
+            kept.push_back(plan.targets[i]);
+            selected.push_back(plan.selected.empty() ? i : plan.selected[i]);
+        }
+    }
+    plan.targets = std::move(kept);
+    plan.selected = std::move(selected);
+}
+
+// Keep only the targets named in a --targets-from list, one path per line.
+// Targets all live in the scanned directory, so lines are matched by file name
+// and both sides are walked in sorted order. Returns the lines that matched nothing
+size_t select_targets(Plan &plan, const std::string &list_path)
+{
+    std::ifstream in(list_path);
+    if (!in)
+    {
+        throw std::runtime_error("Failed to open target list: " + list_path);
+    }
+
+    PathTable names;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.pop_back();
+        }
+        if (!line.empty())
+        {
+            names.push_back(filename_of(line));
+        }
+    }
+    names.sort();
+
+    std::vector<bool> keep(plan.targets.size());
+    size_t kept = 0;
+    size_t missing = 0;
+    size_t j = 0;
+    for (size_t i = 0; i < plan.targets.size() && j < names.size(); i++)
+    {
+        sv name = filename_of(plan.targets[i]);
+        for (; j < names.size() && sv(names[j]) < name; j++)
+        {
+            missing += j == 0 || sv(names[j]) != sv(names[j - 1]);
+        }
+        if (j < names.size() && sv(names[j]) == name)
+        {
+            keep[i] = true;
+            kept++;
+            for (j++; j < names.size() && sv(names[j]) == name; j++)
+            {
+            }
+        }
+    }
+    for (; j < names.size(); j++)
+    {
+        missing += j == 0 || sv(names[j]) != sv(names[j - 1]);
+    }
+
+    if (kept == 0)
+    {
+        throw std::runtime_error("None of the targets listed in " + list_path + " were found");
+    }
+    keep_targets(plan, keep);
+    return missing;
+}
+
+// Source assigned to a target. Targets are split into contiguous blocks,
+// the first (targets % sources) sources receive one extra target. With a
+// shuffle the blocks are taken over the permuted index, so every source still
+// gets its fair count. Targets left out by --targets-from keep their place, so
+// the ones listed get the same source as in the full plan
+size_t source_index_for(const Plan &plan, size_t target_index)
+{
+    if (!plan.selected.empty())
+    {
+        target_index = plan.selected[target_index];
+    }
+    if (plan.shuffle)
+    {
+        target_index = (*plan.shuffle)(target_index);
+    }
+
+    size_t src_count = plan.sources.size();
+    size_t dest_count = plan.assigned_targets;
+
+    size_t base_count = dest_count / src_count; // minimum files per source
+    size_t remainder = dest_count % src_count;  // extra files for the first few sources
+
+    size_t large_blocks = remainder * (base_count + 1);
+    if (target_index < large_blocks)
+    {
+        return target_index / (base_count + 1);
+    }
+    return remainder + (target_index - large_blocks) / base_count;
+}
+
+// 64-bit streaming hash used to find identical files. Not cryptographic,
+// matches are confirmed byte for byte before contents are shared
+class ContentHasher
+{
+public:
+    void update(const void *data, size_t length)
+    {
+        const unsigned char *bytes = static_cast<const unsigned char *>(data);
+        total += length;
+
+        while (tail_length > 0 && length > 0)
+        {
+            tail[tail_length++] = *bytes++;
+            length--;
+            if (tail_length == sizeof(tail))
+            {
+                mix(load(tail));
+                tail_length = 0;
+            }
+        }
+
+        for (; length >= 8; bytes += 8, length -= 8)
+        {
+            mix(load(bytes));
+        }
+
+        std::memcpy(tail, bytes, length);
+        tail_length = length;
+    }
+
+    uint64_t finish()
+    {
+        std::memset(tail + tail_length, 0, sizeof(tail) - tail_length);
+        mix(load(tail));
+
+        uint64_t h = state ^ total;
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDull;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53ull;
+        h ^= h >> 33;
+        return h;
+    }
+
+private:
+    static uint64_t load(const unsigned char *bytes)
+    {
+        uint64_t word;
+        std::memcpy(&word, bytes, sizeof(word));
+        return word;
+    }
+
+    void mix(uint64_t word)
+    {
+        state ^= word * 0x87C37B91114253D5ull;
+        state = ((state << 31) | (state >> 33)) * 0x4CF5AD432745937Full;
+    }
+
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    uint64_t total = 0;
+    unsigned char tail[8];
+    size_t tail_length = 0;
+};
+
+// Hash a whole file through a caller-provided buffer, size receives the bytes read
+uint64_t hash_file(Backend &backend, const SourceHandle &src, Slab &buffer, uint64_t &size)
+{
+    ContentHasher hasher;
+    uint64_t offset = 0;
+    while (uint64_t n = backend.read(src, buffer.data(), buffer.size(), offset))
+    {
+        hasher.update(buffer.data(), n);
+        offset += n;
+    }
+    size = offset;
+    return hasher.finish();
+}
+
+// Clone states of a content entry besides an open fd
+constexpr int CLONE_PENDING = -1;
+constexpr int CLONE_UNAVAILABLE = -2;
+
+// One distinct source content, shared by every source that has it
+struct ContentEntry
+{
+    uint64_t hash = 0;
+    uint64_t size = 0;
+    size_t source = 0; // first source with these contents
+    bool cached = false;
+    bool compressed = false; // data holds the decompressed source and is never evicted
+    std::string data;        // reserved from memory_budget while cached
+    bool clone_unavailable = false; // clone sources themselves live in the write loop's fd pool
+    std::string stored;             // object holding the contents in --store
+};
+
+// Sources collapsed by content for --dir mode
+struct SourceIndex
+{
+    std::vector<ContentEntry> contents;
+    std::vector<uint32_t> content_of; // per source
+};
+
+// Give a cached entry's memory back, it is read from disk from now on
+void drop_cached(ContentEntry &entry)
+{
+    memory_budget.release(entry.data.size());
+    std::string().swap(entry.data);
+    entry.cached = false;
+}
+
+// File a source's contents are read from, its store object where it has one
+const char *source_path(const Plan &plan, size_t source, const ContentEntry *content)
+{
+    return content && !content->stored.empty() ? content->stored.c_str() : plan.sources[source];
+}
+
+// Source formats recognised by their magic bytes
+enum class Compression
+{
+    NONE,
+    GZIP,
+    ZSTD,
+};
+
+Compression detect_compression(const unsigned char *head, size_t length)
+{
+    // gzip with deflate, the only method it defines
+    if (length >= 3 && head[0] == 0x1F && head[1] == 0x8B && head[2] == 8)
+    {
+        return Compression::GZIP;
+    }
+    if (length >= 4 && head[0] == 0x28 && head[1] == 0xB5 && head[2] == 0x2F && head[3] == 0xFD)
+    {
+        return Compression::ZSTD;
+    }
+    return Compression::NONE;
+}
+
+Compression detect_compression(Backend &backend, const SourceHandle &src)
+{
+    unsigned char head[4];
+    uint64_t length = backend.read(src, head, sizeof(head), 0);
+    return detect_compression(head, length);
+}
+
+// Whether a --file source needs the index to be decompressed (--decompress)
+bool is_compressed_file(Backend &backend, const char *path)
+{
+    SourceHandle src = backend.open_source(path);
+    Compression compression;
+    try
+    {
+        compression = detect_compression(backend, src);
+    }
+    catch (...)
+    {
+        backend.close(src.fd);
+        throw;
+    }
+    backend.close(src.fd);
+    return compression != Compression::NONE;
+}
+
+// Streaming decompression functions of libzstd. The library is loaded on first
+// use, builds need no zstd headers and hosts without it only lose zstd sources
+struct ZstdApi
+{
+    struct InBuffer
+    {
+        const void *src;
+        size_t size;
+        size_t pos;
+    };
+    struct OutBuffer
+    {
+        void *dst;
+        size_t size;
+        size_t pos;
+    };
+
+    void *(*create_context)();
+    size_t (*free_context)(void *);
+    size_t (*decompress_stream)(void *, OutBuffer *, InBuffer *);
+    unsigned (*is_error)(size_t);
+    const char *(*error_name)(size_t);
+    unsigned long long (*frame_content_size)(const void *, size_t);
+};
+
+// Static builds can't dlopen, make STATIC=1 defines XREPLACE_NO_ZSTD
+#ifdef XREPLACE_NO_ZSTD
+const ZstdApi &zstd_api()
+{
+    throw std::runtime_error("zstd compressed sources are not supported by the static build");
+}
+#else
+const ZstdApi &zstd_api()
+{
+    static const ZstdApi api = []()
+    {
+        void *library = dlopen("libzstd.so.1", RTLD_NOW | RTLD_LOCAL);
+        if (!library)
+        {
+            throw std::runtime_error("zstd compressed sources need libzstd.so.1: " + std::string(dlerror()));
+        }
+
+        auto symbol = [&](const char *name)
+        {
+            void *address = dlsym(library, name);
+            if (!address)
+            {
+                throw std::runtime_error("libzstd.so.1 lacks " + std::string(name));
+            }
+            return address;
+        };
+
+        ZstdApi api;
+        api.create_context = reinterpret_cast<void *(*)()>(symbol("ZSTD_createDCtx"));
+        api.free_context = reinterpret_cast<size_t (*)(void *)>(symbol("ZSTD_freeDCtx"));
+        api.decompress_stream = reinterpret_cast<size_t (*)(void *, ZstdApi::OutBuffer *, ZstdApi::InBuffer *)>(symbol("ZSTD_decompressStream"));
+        api.is_error = reinterpret_cast<unsigned (*)(size_t)>(symbol("ZSTD_isError"));
+        api.error_name = reinterpret_cast<const char *(*)(size_t)>(symbol("ZSTD_getErrorName"));
+        api.frame_content_size = reinterpret_cast<unsigned long long (*)(const void *, size_t)>(symbol("ZSTD_getFrameContentSize"));
+        return api;
+    }();
+    return api;
+}
+#endif
+
+// Decompressed bytes collected in a content entry. data.size() is always what
+// is reserved from memory_budget, so a failed entry is released by drop_cached
+class DecompressedOutput
+{
+public:
+    explicit DecompressedOutput(ContentEntry &entry) : entry(entry)
+    {
+    }
+
+    // Size the output up front when the format tells the final size
+    void expect(uint64_t bytes)
+    {
+        if (bytes > entry.data.size() && bytes <= memory_budget.limit() && memory_budget.try_reserve(bytes - entry.data.size()))
+        {
+            entry.data.resize(bytes);
+        }
+    }
+
+    // Room for the next chunk, growing the output when it is full
+    std::pair<char *, size_t> space()
+    {
+        if (used == entry.data.size())
+        {
+            size_t extra = std::max<size_t>(entry.data.size(), SLAB_SIZE);
+            memory_budget.reserve(extra, "a decompressed source");
+            entry.data.resize(entry.data.size() + extra);
+        }
+        return {&entry.data[used], entry.data.size() - used};
+    }
+
+    void produced(size_t bytes)
+    {
+        used += bytes;
+    }
+
+    void finish()
+    {
+        memory_budget.release(entry.data.size() - used);
+        entry.data.resize(used);
+        entry.data.shrink_to_fit();
+        entry.size = used;
+        entry.cached = true;
+        entry.compressed = true;
+    }
+
+private:
+    ContentEntry &entry;
+    size_t used = 0;
+};
+
+// Decompress a gzip source into the entry, concatenated members included
+void inflate_gzip(Backend &backend, const SourceHandle &src, ContentEntry &entry, Slab &buffer)
+{
+    DecompressedOutput output(entry);
+
+    // The trailer holds the uncompressed size modulo 4 GiB
+    unsigned char trailer[4];
+    if (src.size >= 18 && backend.read(src, trailer, sizeof(trailer), src.size - 4) == sizeof(trailer))
+    {
+        output.expect(trailer[0] | trailer[1] << 8 | trailer[2] << 16 | static_cast<uint32_t>(trailer[3]) << 24);
+    }
+
+    z_stream stream{};
+    if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK)
+    {
+        throw std::runtime_error("Failed to set up gzip decompression");
+    }
+
+    try
+    {
+        uint64_t offset = 0;
+        bool input_done = false;
+        int status = Z_OK;
+        for (;;)
+        {
+            if (stream.avail_in == 0 && !input_done)
+            {
+                uint64_t n = backend.read(src, buffer.data(), buffer.size(), offset);
+                offset += n;
+                input_done = n == 0;
+                stream.next_in = reinterpret_cast<Bytef *>(buffer.data());
+                stream.avail_in = static_cast<uInt>(n);
+            }
+            if (status == Z_STREAM_END)
+            {
+                if (stream.avail_in == 0 && input_done)
+                {
+                    break;
+                }
+                inflateReset(&stream); // another member follows
+            }
+
+            auto [out, room] = output.space();
+            room = std::min<size_t>(room, UINT32_MAX);
+            stream.next_out = reinterpret_cast<Bytef *>(out);
+            stream.avail_out = static_cast<uInt>(room);
+            status = inflate(&stream, Z_NO_FLUSH);
+            output.produced(room - stream.avail_out);
+
+            if (status == Z_BUF_ERROR && input_done)
+            {
+                throw std::runtime_error("Truncated gzip source: " + std::string(src.path));
+            }
+            if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR)
+            {
+                throw std::runtime_error("Corrupt gzip source " + std::string(src.path) + ": " + (stream.msg ? stream.msg : "invalid data"));
+            }
+        }
+    }
+    catch (...)
+    {
+        inflateEnd(&stream);
+        throw;
+    }
+    inflateEnd(&stream);
+    output.finish();
+}
+
+// Decompress a zstd source into the entry, concatenated frames included
+void decompress_zstd(Backend &backend, const SourceHandle &src, ContentEntry &entry, Slab &buffer)
+{
+    const ZstdApi &zstd = zstd_api();
+    DecompressedOutput output(entry);
+
+    void *context = zstd.create_context();
+    if (!context)
+    {
+        throw std::runtime_error("Failed to set up zstd decompression");
+    }
+
+    try
+    {
+        ZstdApi::InBuffer in{buffer.data(), 0, 0};
+        uint64_t offset = 0;
+        bool input_done = false;
+        size_t remaining = 0; // zero once every frame so far is complete and flushed
+        for (;;)
+        {
+            if (in.pos == in.size && !input_done)
+            {
+                uint64_t n = backend.read(src, buffer.data(), buffer.size(), offset);
+                if (offset == 0)
+                {
+                    // Unknown and error sizes are huge and simply not reserved
+                    output.expect(zstd.frame_content_size(buffer.data(), n));
+                }
+                offset += n;
+                input_done = n == 0;
+                in = {buffer.data(), n, 0};
+            }
+            if (input_done && remaining == 0)
+            {
+                break;
+            }
+
+            auto [out, room] = output.space();
+            ZstdApi::OutBuffer out_buffer{out, room, 0};
+            size_t consumed = in.pos;
+            size_t result = zstd.decompress_stream(context, &out_buffer, &in);
+            if (zstd.is_error(result))
+            {
+                throw std::runtime_error("Corrupt zstd source " + std::string(src.path) + ": " + zstd.error_name(result));
+            }
+            output.produced(out_buffer.pos);
+            // A call without progress reports what the next frame would need
+            if (in.pos > consumed || out_buffer.pos > 0)
+            {
+                remaining = result;
+            }
+
+            // Input used up and room left over, a frame was cut short
+            if (input_done && out_buffer.pos < out_buffer.size)
+            {
+                break;
+            }
+        }
+
+        if (remaining != 0)
+        {
+            throw std::runtime_error("Truncated zstd source: " + std::string(src.path));
+        }
+    }
+    catch (...)
+    {
+        zstd.free_context(context);
+        throw;
+    }
+    zstd.free_context(context);
+    output.finish();
+}
+
+// Hash one source, keeping its contents if they fit into the cache. The cache
+// leaves a quarter of the memory budget to buffers and tables. With --decompress,
+// compressed sources are decompressed into the cache once and stay there, the
+// write loop never reads them from disk
+void index_source(Backend &backend, const SourceHandle &src, ContentEntry &entry, Slab &buffer, bool decompress)
+{
+    ContentHasher hasher;
+    entry.size = src.size;
+
+    Compression compression = decompress ? detect_compression(backend, src) : Compression::NONE;
+    if (compression != Compression::NONE)
+    {
+        if (compression == Compression::GZIP)
+        {
+            inflate_gzip(backend, src, entry, buffer);
+        }
+        else
+        {
+            decompress_zstd(backend, src, entry, buffer);
+        }
+        hasher.update(entry.data.data(), entry.data.size());
+    }
+    else if (memory_budget.try_reserve(src.size, memory_budget.limit() / 4))
+    {
+        entry.data.resize(src.size);
+        uint64_t offset = 0;
+        while (offset < src.size)
+        {
+            uint64_t n = backend.read(src, &entry.data[offset], src.size - offset, offset);
+            if (n == 0)
+            {
+                break;
+            }
+            offset += n;
+        }
+        memory_budget.release(src.size - offset);
+        entry.data.resize(offset);
+        entry.size = offset;
+        entry.cached = true;
+        hasher.update(entry.data.data(), entry.data.size());
+    }
+    else
+    {
+        entry.hash = hash_file(backend, src, buffer, entry.size);
+        return;
+    }
+
+    entry.hash = hasher.finish();
+}
+
+// Write a file next to path and rename it over path, so readers and an
+// interrupted run only ever see the old or the new contents. The temporary
+// name carries the pid, concurrent runs don't write into each other's file
+template <typename F>
+void write_file_atomically(const std::string &path, const char *what, F write)
+{
+    std::string tmp_path = path + ".tmp." + std::to_string(getpid());
+    {
+        std::ofstream out(tmp_path, std::ios::trunc);
+        if (!out)
+        {
+            throw std::runtime_error("Failed to open " + std::string(what) + ": " + tmp_path);
+        }
+        write(out);
+        if (!out.flush())
+        {
+            out.close();
+            std::remove(tmp_path.c_str());
+            throw std::runtime_error("Failed to write " + std::string(what) + ": " + tmp_path);
+        }
+    }
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        std::remove(tmp_path.c_str());
+        throw std::runtime_error("Failed to replace " + std::string(what) + ": " + path);
+    }
+}
+
+// What the index keys on. ctime can't be set back, so a source rewritten with
+// its old mtime restored still counts as changed
+struct FileIdentity
+{
+    uint64_t size = 0;
+    uint64_t device = 0;
+    uint64_t inode = 0;
+    int64_t mtime_ns = 0;
+    int64_t ctime_ns = 0;
+
+    bool operator==(const FileIdentity &) const = default;
+};
+
+// Content-addressed copies of sources kept between runs (--store). objects/ holds
+// one file per distinct content, named <hash>-<size>. index maps the identity of
+// a source file to its content, so an unchanged source is neither read nor hashed
+// again and targets can be cloned from the object. Objects appear by rename and
+// never change. Runs saving the index at the same moment can lose each other's entries.
+// --decompress runs map compressed sources to other contents and keep their own index
+class SourceStore
+{
+public:
+    SourceStore(const std::string &dir, bool decompress) : objects_dir(dir + "/objects"), index_path(dir + (decompress ? "/index-decompressed" : "/index"))
+    {
+        for (const std::string &path : {dir, objects_dir})
+        {
+            if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+            {
+                throw_errno("Failed to create store directory: ", path);
+            }
+        }
+
+        load();
+    }
+
+    // Fill in hash, size and object of a source the store already knows
+    bool lookup(const char *path, ContentEntry &entry) const
+    {
+        uint64_t hash;
+        uint64_t size;
+        if (parse_object_path(path, hash, size))
+        {
+            entry.hash = hash;
+            entry.size = size;
+            entry.stored = path;
+            return true;
+        }
+
+        struct stat status;
+        if (::stat(path, &status) != 0)
+        {
+            return false;
+        }
+        auto it = records.find(identity_of(status));
+        if (it == records.end())
+        {
+            return false;
+        }
+
+        std::string object = object_path(it->second.hash, it->second.size);
+        if (::stat(object.c_str(), &status) != 0 || static_cast<uint64_t>(status.st_size) != it->second.size)
+        {
+            return false;
+        }
+        entry.hash = it->second.hash;
+        entry.size = it->second.size;
+        entry.stored = std::move(object);
+        return true;
+    }
+
+    // Identity of an open source, taken before it is indexed
+    static FileIdentity identity(int fd)
+    {
+        struct stat status;
+        return fstat(fd, &status) == 0 ? identity_of(status) : FileIdentity{};
+    }
+
+    // Put an indexed source into the store, from its cached contents or by
+    // cloning or copying the open file. Skipped if the source changed meanwhile.
+    // The hash only names objects: an object that already exists is compared
+    // byte for byte, and a source that differs from it stays out of the store
+    void ingest(Backend &backend, const SourceHandle &src, const FileIdentity &before, ContentEntry &entry, Slab &buffer)
+    {
+        if (before.inode == 0)
+        {
+            return;
+        }
+
+        struct stat status;
+        std::string object = object_path(entry.hash, entry.size);
+        bool created = false;
+        if (::stat(object.c_str(), &status) != 0)
+        {
+            std::string tmp_path = objects_dir + "/.ingest-XXXXXX";
+            int fd = mkstemp(tmp_path.data());
+            if (fd < 0)
+            {
+                throw_errno("Failed to create store object in: ", objects_dir);
+            }
+
+            try
+            {
+                if (entry.cached)
+                {
+                    backend.write(fd, entry.data.data(), entry.data.size(), tmp_path.c_str());
+                }
+                else if (!backend.clone(src.fd, fd, tmp_path.c_str()))
+                {
+                    backend.copy(src, fd, tmp_path.c_str());
+                }
+                backend.sync(fd, tmp_path.c_str());
+                fchmod(fd, 0444);
+            }
+            catch (...)
+            {
+                backend.close(fd);
+                unlink(tmp_path.c_str());
+                throw;
+            }
+            backend.close(fd);
+
+            // A copy has to hold what was hashed, cached contents always do
+            if (!entry.cached && !(identity(src.fd) == before))
+            {
+                unlink(tmp_path.c_str());
+                return;
+            }
+
+            // link never replaces, an object another run added meanwhile is compared below
+            created = link(tmp_path.c_str(), object.c_str()) == 0;
+            int error = errno;
+            unlink(tmp_path.c_str());
+            if (!created && error != EEXIST)
+            {
+                errno = error;
+                throw_errno("Failed to add store object: ", object);
+            }
+            stored_count += created ? 1 : 0;
+        }
+
+        // Reading the source again only proves something if it is still what was hashed
+        if (!created && (!holds_entry(backend, src, entry, object, buffer) || (!entry.cached && !(identity(src.fd) == before))))
+        {
+            return;
+        }
+
+        entry.stored = std::move(object);
+        std::lock_guard<std::mutex> lock(added_mutex);
+        added.push_back({entry.hash, entry.size, before});
+    }
+
+    static FileIdentity identity_of(const struct stat &status)
+    {
+        return {static_cast<uint64_t>(status.st_size), static_cast<uint64_t>(status.st_dev), static_cast<uint64_t>(status.st_ino),
+                status.st_mtim.tv_sec * 1000000000ll + status.st_mtim.tv_nsec, status.st_ctim.tv_sec * 1000000000ll + status.st_ctim.tv_nsec};
+    }
+
+    // Write the index with this run's sources added
+    void save()
+    {
+        if (added.empty())
+        {
+            return;
+        }
+        load(); // entries other runs saved meanwhile
+        for (const auto &record : added)
+        {
+            records[record.identity] = record;
+        }
+        added.clear();
+
+        write_file_atomically(index_path, "store index", [&](std::ostream &out)
+        {
+            for (const auto &[identity, record] : records)
+            {
+                out << std::hex << record.hash << std::dec << " " << record.size << " " << identity.size << " " << identity.device << " " << identity.inode << " " << identity.mtime_ns << " " << identity.ctime_ns << "\n";
+            }
+        });
+    }
+
+    // Object named by an @<hash> reference, any unique prefix of the hash will do
+    std::string resolve(sv prefix) const
+    {
+        DIR *dir = opendir(objects_dir.c_str());
+        if (!dir)
+        {
+            throw_errno("Failed to open store directory: ", objects_dir);
+        }
+
+        std::string match;
+        size_t matches = 0;
+        while (dirent *entry = readdir(dir))
+        {
+            uint64_t hash;
+            uint64_t size;
+            std::string path = objects_dir + "/" + entry->d_name;
+            if (!prefix.empty() && sv(entry->d_name).substr(0, prefix.size()) == prefix && parse_object_path(path, hash, size))
+            {
+                match = std::move(path);
+                matches++;
+            }
+        }
+        closedir(dir);
+
+        if (matches != 1)
+        {
+            throw std::runtime_error((matches == 0 ? "No stored source matches @" : "More than one stored source matches @") + std::string(prefix));
+        }
+        return match;
+    }
+
+    std::string object_path(uint64_t hash, uint64_t size) const
+    {
+        char name[48];
+        std::snprintf(name, sizeof(name), "/%016llx-%llu", static_cast<unsigned long long>(hash), static_cast<unsigned long long>(size));
+        return objects_dir + name;
+    }
+
+    uint64_t stored() const
+    {
+        return stored_count;
+    }
+
+private:
+    struct Record
+    {
+        uint64_t hash = 0;
+        uint64_t size = 0; // of the contents, a compressed source's file is smaller
+        FileIdentity identity;
+    };
+
+    struct IdentityHash
+    {
+        size_t operator()(const FileIdentity &identity) const
+        {
+            return std::hash<uint64_t>()(identity.inode ^ (identity.device << 32) ^ static_cast<uint64_t>(identity.mtime_ns));
+        }
+    };
+
+    void load()
+    {
+        std::ifstream in(index_path);
+        Record record;
+        while (in >> std::hex >> record.hash >> std::dec >> record.size >> record.identity.size >> record.identity.device >> record.identity.inode >> record.identity.mtime_ns >> record.identity.ctime_ns)
+        {
+            records[record.identity] = record;
+        }
+    }
+
+    // Whether an existing object holds exactly the indexed contents, compared
+    // with the cache or the open source in two halves of the buffer
+    static bool holds_entry(Backend &backend, const SourceHandle &src, const ContentEntry &entry, const std::string &object_path, Slab &buffer)
+    {
+        SourceHandle object = backend.open_source(object_path.c_str());
+        bool same = object.size == entry.size;
+        try
+        {
+            size_t half = buffer.size() / 2;
+            char *stored = buffer.data();
+            char *source = buffer.data() + half;
+            for (uint64_t offset = 0; same && offset < entry.size;)
+            {
+                uint64_t n = backend.read(object, stored, std::min<uint64_t>(half, entry.size - offset), offset);
+                const char *expected = entry.cached ? entry.data.data() + offset : source;
+                if (!entry.cached)
+                {
+                    uint64_t got = 0;
+                    for (uint64_t m; got < n && (m = backend.read(src, source + got, n - got, offset + got)) > 0;)
+                    {
+                        got += m;
+                    }
+                    same = got == n;
+                }
+                same = same && n > 0 && std::memcmp(stored, expected, n) == 0;
+                offset += n;
+            }
+        }
+        catch (...)
+        {
+            backend.close(object.fd);
+            throw;
+        }
+        backend.close(object.fd);
+        return same;
+    }
+
+    // Objects are recognised by name, so @<hash> sources skip the index
+    bool parse_object_path(sv path, uint64_t &hash, uint64_t &size) const
+    {
+        if (path.size() <= objects_dir.size() + 1 || path.substr(0, objects_dir.size()) != objects_dir || path[objects_dir.size()] != '/')
+        {
+            return false;
+        }
+        std::string name(path.substr(objects_dir.size() + 1));
+        unsigned long long parsed_hash;
+        unsigned long long parsed_size;
+        int consumed = 0;
+        if (name.size() < 18 || std::sscanf(name.c_str(), "%16llx-%llu%n", &parsed_hash, &parsed_size, &consumed) != 2 || static_cast<size_t>(consumed) != name.size())
+        {
+            return false;
+        }
+        hash = parsed_hash;
+        size = parsed_size;
+        return true;
+    }
+
+    std::string objects_dir;
+    std::string index_path;
+    std::unordered_map<FileIdentity, Record, IdentityHash> records;
+    std::vector<Record> added; // this run's sources, merged by save()
+    std::mutex added_mutex;
+    std::atomic<uint64_t> stored_count{0};
+};
+
+// Hash all sources in parallel and collapse identical ones into a single content entry.
+// With a store, sources it knows are taken from it unread and new ones are added
+SourceIndex build_source_index(Backend &backend, const Plan &plan, RunStats &stats, SourceStore *store, bool decompress)
+{
+    size_t count = plan.sources.size();
+    std::vector<ContentEntry> entries(count);
+    std::atomic<size_t> next{0};
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    std::atomic<uint64_t> store_hits{0};
+
+    // Finished entries can give their cache up when a hashing thread needs a buffer
+    std::vector<size_t> evictable;
+    std::mutex evict_mutex;
+    memory_budget.set_evictor([&](uint64_t needed)
+    {
+        std::lock_guard<std::mutex> lock(evict_mutex);
+        uint64_t freed = 0;
+        while (freed < needed && !evictable.empty())
+        {
+            freed += entries[evictable.back()].data.size();
+            drop_cached(entries[evictable.back()]);
+            evictable.pop_back();
+        }
+        return freed;
+    });
+
+    auto worker = [&](size_t worker_index)
+    {
+        try
+        {
+            pin_worker(worker_index);
+            Slab &buffer = thread_slab();
+            for (size_t i; !cancel_requested() && (i = next++) < count;)
+            {
+                entries[i].source = i;
+                if (store && store->lookup(plan.sources[i], entries[i]))
+                {
+                    store_hits++;
+                    continue;
+                }
+
+                SourceHandle src = backend.open_source(plan.sources[i]);
+                try
+                {
+                    FileIdentity identity = store ? SourceStore::identity(src.fd) : FileIdentity{};
+                    index_source(backend, src, entries[i], buffer, decompress);
+                    if (store)
+                    {
+                        store->ingest(backend, src, identity, entries[i], buffer);
+                    }
+                }
+                catch (...)
+                {
+                    backend.close(src.fd);
+                    throw;
+                }
+                backend.close(src.fd);
+
+                if (entries[i].cached && !entries[i].compressed)
+                {
+                    std::lock_guard<std::mutex> lock(evict_mutex);
+                    evictable.push_back(i);
+                }
+            }
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error)
+            {
+                error = std::current_exception();
+            }
+            next = count;
+        }
+    };
+
+    size_t thread_count = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), count);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < thread_count; i++)
+    {
+        threads.emplace_back(worker, i);
+    }
+    worker(0);
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    memory_budget.set_evictor(nullptr);
+    stats.store_hits = store_hits;
+    stats.stored_sources = store ? store->stored() : 0;
+
+    if (error)
+    {
+        for (auto &entry : entries)
+        {
+            drop_cached(entry);
+        }
+        std::rethrow_exception(error);
+    }
+
+    // A cancelled index is incomplete, the phases after it stop at their own cancel check
+    if (cancel_requested())
+    {
+        for (auto &entry : entries)
+        {
+            drop_cached(entry);
+        }
+        return SourceIndex();
+    }
+
+    // Collapse in source order so the first source of each content represents it
+    SourceIndex index;
+    index.content_of.resize(count);
+    std::unordered_multimap<uint64_t, uint32_t> by_hash;
+    for (auto &entry : entries)
+    {
+        uint32_t match = UINT32_MAX;
+        auto range = by_hash.equal_range(entry.hash);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            const ContentEntry &existing = index.contents[it->second];
+            // Equal hashes name the same store object
+            if ((entry.cached && existing.cached && existing.data == entry.data) || (!entry.stored.empty() && entry.stored == existing.stored))
+            {
+                match = it->second;
+                break;
+            }
+        }
+
+        if (match != UINT32_MAX)
+        {
+            index.content_of[entry.source] = match;
+            stats.collapsed_sources++;
+            drop_cached(entry);
+            continue;
+        }
+
+        uint32_t content = static_cast<uint32_t>(index.contents.size());
+        index.content_of[entry.source] = content;
+        by_hash.emplace(entry.hash, content);
+        index.contents.push_back(std::move(entry));
+    }
+
+    return index;
+}
+
+// One target write and its outcome. It is filled in by whichever thread runs it and
+// touches no shared state, the write loop applies the results afterwards
+struct TargetJob
+{
+    Backend *backend = nullptr; // the BackendT run_target_job is instantiated for
+    const char *dest_path = nullptr;
+    SourceHandle src;                      // used when contents is null
+    const std::string *contents = nullptr; // cached source contents
+    int clone_fd = CLONE_UNAVAILABLE;      // target already holding the contents
+    bool clone_src = false;                // src is a store object, try sharing its extents
+
+    uint64_t bytes = 0;
+    bool cloned = false;
+    bool clone_failed = false;
+    int written_fd = CLONE_UNAVAILABLE; // this target reopened as clone source, when clone_fd is CLONE_PENDING
+};
+
+// How each target is finished once written, picked once per run (see perform_write)
+struct NoSync
+{
+    template <typename BackendT>
+    static void finish(BackendT &, int, const char *)
+    {
+    }
+};
+
+struct SyncEach
+{
+    template <typename BackendT>
+    static void finish(BackendT &backend, int fd, const char *path)
+    {
+        backend.sync(fd, path);
+    }
+};
+
+// Replace one target with the source. Targets written from cached contents are
+// cloned from the first target that holds them, others from their store object,
+// where the file system can share extents. BackendT is a final class, so the backend calls are direct
+template <typename BackendT, typename Durability>
+void run_target_job(TargetJob &job)
+{
+    BackendT &backend = static_cast<BackendT &>(*job.backend);
+    int dst_fd = backend.open_target(job.dest_path);
+    try
+    {
+        if (!job.contents && job.clone_src && backend.clone(job.src.fd, dst_fd, job.dest_path))
+        {
+            job.cloned = true;
+            job.bytes = job.src.size;
+        }
+        else if (!job.contents)
+        {
+            job.clone_failed = job.clone_src;
+            job.bytes = backend.copy(job.src, dst_fd, job.dest_path);
+        }
+        else if (job.clone_fd >= 0 && backend.clone(job.clone_fd, dst_fd, job.dest_path))
+        {
+            job.cloned = true;
+            job.bytes = job.contents->size();
+        }
+        else
+        {
+            job.clone_failed = job.clone_fd >= 0;
+            backend.write(dst_fd, job.contents->data(), job.contents->size(), job.dest_path);
+            job.bytes = job.contents->size();
+        }
+
+        Durability::finish(backend, dst_fd, job.dest_path);
+    }
+    catch (...)
+    {
+        backend.close(dst_fd);
+        throw;
+    }
+    backend.close(dst_fd);
+
+    // Unreadable targets just aren't used as clone source
+    if (job.contents && job.clone_fd == CLONE_PENDING)
+    {
+        try
+        {
+            job.written_fd = backend.open_source(job.dest_path).fd;
+        }
+        catch (const std::system_error &)
+        {
+            job.written_fd = CLONE_UNAVAILABLE;
+        }
+    }
+}
+
+// Coroutine layer of the write loop. Every target is a pipeline written as
+// straight-line code that awaits its blocking calls, which run on executor
+// threads, and its retry delays. Pipelines only ever resume on the thread
+// inside Executor::run, so the state they share needs no locking. A target's
+// open, copy, sync and close are one blocking call that takes a thread
+// throughout, so at most --jobs pipelines do I/O at a time. Only pipelines
+// waiting out a retry delay are held beyond that, without a thread
+
+// Thrown from a blocking call that missed its timeout
+class TimeoutError : public std::runtime_error
+{
+public:
+    TimeoutError() : std::runtime_error("Timed out")
+    {
+    }
+};
+
+// Queue on a vector that keeps its capacity. std::deque allocates a new block
+// every 512 bytes pushed through it, which a warmed-up write loop can't afford
+template <typename T>
+class Fifo
+{
+public:
+    bool empty() const
+    {
+        return head == items.size();
+    }
+
+    void push_back(T item)
+    {
+        // Reuse the consumed front instead of growing
+        if (head == items.size())
+        {
+            items.clear();
+            head = 0;
+        }
+        else if (head * 2 >= items.size())
+        {
+            items.erase(items.begin(), items.begin() + head);
+            head = 0;
+        }
+        items.push_back(item);
+    }
+
+    T &front()
+    {
+        return items[head];
+    }
+
+    void pop_front()
+    {
+        head++;
+    }
+
+private:
+    std::vector<T> items;
+    size_t head = 0;
+};
+
+// Recycles coroutine frames and blocking operations by size, so a warmed-up
+// write loop doesn't allocate per target. Blocks are kept until exit
+class BlockPool
+{
+public:
+    static void *allocate(size_t size)
+    {
+        size_t bucket = (size + GRANULE - 1) / GRANULE;
+        if (bucket >= BUCKETS)
+        {
+            return ::operator new(size);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!free_blocks[bucket].empty())
+            {
+                void *block = free_blocks[bucket].back();
+                free_blocks[bucket].pop_back();
+                return block;
+            }
+        }
+        return ::operator new(bucket * GRANULE);
+    }
+
+    static void deallocate(void *block, size_t size)
+    {
+        size_t bucket = (size + GRANULE - 1) / GRANULE;
+        if (bucket >= BUCKETS)
+        {
+            ::operator delete(block);
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        free_blocks[bucket].push_back(block);
+    }
+
+private:
+    static constexpr size_t GRANULE = 64;
+    static constexpr size_t BUCKETS = 64;
+
+    static inline std::mutex mutex;
+    static inline std::vector<void *> free_blocks[BUCKETS];
+};
+
+// Blocking call handed to an executor thread. Owned by the awaiting pipeline,
+// the thread running it and a pending timeout, whoever lets go last frees it
+struct Operation
+{
+    virtual ~Operation() = default;
+    virtual void execute() noexcept = 0;
+
+    void release()
+    {
+        if (--references == 0)
+        {
+            delete this;
+        }
+    }
+
+    static void *operator new(size_t size)
+    {
+        return BlockPool::allocate(size);
+    }
+
+    static void operator delete(void *block, size_t size)
+    {
+        BlockPool::deallocate(block, size);
+    }
+
+    std::atomic<int> references{1};
+    std::coroutine_handle<> waiter;
+    std::exception_ptr error;
+    bool finished = false;  // guarded by the executor mutex
+    bool abandoned = false; // timed out, the thread running it is replaced
+};
+
+template <typename F>
+struct BlockingOperation : Operation
+{
+    explicit BlockingOperation(F function) : function(std::move(function))
+    {
+    }
+
+    void execute() noexcept override
+    {
+        try
+        {
+            result.emplace(function());
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+    }
+
+    F function;
+    std::optional<std::invoke_result_t<F &>> result;
+};
+
+class Executor;
+
+// Lazily started coroutine. Awaiting a Task runs it to completion,
+// Executor::spawn runs it detached and frees it when it finishes
+class Task
+{
+public:
+    struct promise_type;
+
+    struct FinalAwaiter
+    {
+        bool await_ready() noexcept
+        {
+            return false;
+        }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept;
+
+        void await_resume() noexcept
+        {
+        }
+    };
+
+    struct promise_type
+    {
+        std::coroutine_handle<> continuation;
+        Executor *owner = nullptr; // set for detached tasks
+        std::exception_ptr error;
+
+        Task get_return_object()
+        {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        FinalAwaiter final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_void() noexcept
+        {
+        }
+
+        void unhandled_exception() noexcept
+        {
+            error = std::current_exception();
+        }
+
+        static void *operator new(size_t size)
+        {
+            return BlockPool::allocate(size);
+        }
+
+        static void operator delete(void *block, size_t size)
+        {
+            BlockPool::deallocate(block, size);
+        }
+    };
+
+    Task(Task &&other) noexcept : handle(std::exchange(other.handle, nullptr))
+    {
+    }
+
+    Task &operator=(Task &&) = delete;
+
+    ~Task()
+    {
+        if (handle)
+        {
+            handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+
+    void await_resume()
+    {
+        if (handle.promise().error)
+        {
+            std::rethrow_exception(handle.promise().error);
+        }
+    }
+
+    std::coroutine_handle<promise_type> release()
+    {
+        return std::exchange(handle, nullptr);
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle)
+    {
+    }
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+// Runs blocking calls on a few threads and resumes their pipelines on the
+// thread calling run(). A call that misses its timeout (hung FUSE or NFS
+// mount) is abandoned together with its thread, which is replaced and exits
+// once the blocked call returns. Without threads, calls without a timeout run
+// inline and cost no more than a plain function call
+class Executor
+{
+public:
+    explicit Executor(size_t threads) : shared(std::make_shared<Shared>()), inline_calls(threads == 0)
+    {
+        std::lock_guard<std::mutex> lock(shared->mutex);
+        for (size_t i = 0; i < threads; i++)
+        {
+            start_thread();
+        }
+    }
+
+    Executor(const Executor &) = delete;
+    Executor &operator=(const Executor &) = delete;
+
+    ~Executor()
+    {
+        std::unique_lock<std::mutex> lock(shared->mutex);
+        shared->stop = true;
+        shared->work.notify_all();
+        shared->exited.wait(lock, [&]() { return shared->live_threads == 0; });
+        lock.unlock();
+
+        for (auto &timer : timers)
+        {
+            if (timer.expires)
+            {
+                timer.expires->release();
+            }
+        }
+    }
+
+    // Awaitable running function on an executor thread, returns its result or
+    // rethrows its exception. Throws TimeoutError once timeout (if set) passes
+    template <typename F>
+    class [[nodiscard]] Blocking
+    {
+    public:
+        Blocking(Executor &executor, F function, std::chrono::milliseconds timeout)
+            : executor(executor), operation(new BlockingOperation<F>(std::move(function))), timeout(timeout)
+        {
+        }
+
+        Blocking(const Blocking &) = delete;
+        Blocking &operator=(const Blocking &) = delete;
+
+        ~Blocking()
+        {
+            operation->release();
+        }
+
+        bool await_ready() const noexcept
+        {
+            if (executor.inline_calls && timeout.count() == 0)
+            {
+                operation->execute();
+                return true;
+            }
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            operation->waiter = handle;
+            executor.submit(operation, timeout);
+        }
+
+        auto await_resume()
+        {
+            if (operation->abandoned)
+            {
+                throw TimeoutError();
+            }
+            if (timeout.count() > 0)
+            {
+                executor.cancel_timer(operation);
+            }
+            if (operation->error)
+            {
+                std::rethrow_exception(operation->error);
+            }
+            return std::move(*operation->result);
+        }
+
+    private:
+        Executor &executor;
+        BlockingOperation<F> *operation;
+        std::chrono::milliseconds timeout;
+    };
+
+    template <typename F>
+    Blocking<F> blocking(F function, std::chrono::milliseconds timeout = std::chrono::milliseconds(0))
+    {
+        return Blocking<F>(*this, std::move(function), timeout);
+    }
+
+    // Awaitable resuming at the given time, or early once a signal asks to stop
+    struct [[nodiscard]] Sleep
+    {
+        Executor &executor;
+        std::chrono::steady_clock::time_point when;
+
+        bool await_ready() const noexcept
+        {
+            return when <= std::chrono::steady_clock::now();
+        }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            executor.add_timer({when, handle, nullptr});
+        }
+
+        void await_resume() noexcept
+        {
+        }
+    };
+
+    Sleep sleep_until(std::chrono::steady_clock::time_point when)
+    {
+        return {*this, when};
+    }
+
+    // Start a task that runs on its own. It runs right away until it first
+    // suspends, run() waits for it to finish
+    void spawn(Task task)
+    {
+        auto handle = task.release();
+        handle.promise().owner = this;
+        tasks++;
+        handle.resume();
+    }
+
+    void post(std::coroutine_handle<> handle)
+    {
+        std::lock_guard<std::mutex> lock(shared->mutex);
+        shared->ready.push_back(handle);
+        shared->wake.notify_one();
+    }
+
+    // Resume pipelines until every spawned task has finished, then rethrow
+    // the first exception one of them let escape
+    void run()
+    {
+        std::vector<std::coroutine_handle<>> resumable;
+        while (tasks > 0)
+        {
+            {
+                // Wake up regularly so a signal cuts retry delays short
+                std::unique_lock<std::mutex> lock(shared->mutex);
+                auto wake_at = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+                if (!timers.empty())
+                {
+                    wake_at = std::min(wake_at, timers.front().when);
+                }
+                shared->wake.wait_until(lock, wake_at, [&]() { return !shared->ready.empty(); });
+                resumable.swap(shared->ready);
+            }
+
+            fire_timers(resumable);
+            for (auto handle : resumable)
+            {
+                handle.resume();
+            }
+            resumable.clear();
+        }
+
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+    friend struct Task::FinalAwaiter;
+
+    struct Shared
+    {
+        std::mutex mutex;
+        std::condition_variable work;   // executor threads wait for operations
+        std::condition_variable wake;   // run() waits for completions
+        std::condition_variable exited; // the destructor waits for threads
+        Fifo<Operation *> queue;
+        std::vector<std::coroutine_handle<>> ready;
+        size_t live_threads = 0;
+        size_t started_threads = 0;
+        bool stop = false;
+    };
+
+    // Resumes a sleeping pipeline, or gives up on an operation (expires)
+    struct Timer
+    {
+        std::chrono::steady_clock::time_point when;
+        std::coroutine_handle<> waiter;
+        Operation *expires;
+
+        bool operator>(const Timer &other) const
+        {
+            return when > other.when;
+        }
+    };
+
+    void submit(Operation *operation, std::chrono::milliseconds timeout)
+    {
+        operation->references++;
+        if (timeout.count() > 0)
+        {
+            operation->references++;
+            add_timer({std::chrono::steady_clock::now() + timeout, {}, operation});
+        }
+
+        std::lock_guard<std::mutex> lock(shared->mutex);
+        shared->queue.push_back(operation);
+        shared->work.notify_one();
+    }
+
+    void add_timer(Timer timer)
+    {
+        timers.push_back(timer);
+        std::push_heap(timers.begin(), timers.end(), std::greater<Timer>());
+    }
+
+    // Drop the timeout of an operation that finished in time, so the operation
+    // goes back to the BlockPool now rather than when the timeout would pass.
+    // The heap holds one timer per call in flight or retry delay, a scan is cheap
+    void cancel_timer(Operation *operation)
+    {
+        auto it = std::find_if(timers.begin(), timers.end(), [&](const Timer &timer) { return timer.expires == operation; });
+        if (it == timers.end())
+        {
+            return;
+        }
+        *it = timers.back();
+        timers.pop_back();
+        std::make_heap(timers.begin(), timers.end(), std::greater<Timer>());
+        operation->release();
+    }
+
+    void fire_timers(std::vector<std::coroutine_handle<>> &resumable)
+    {
+        // Nothing should wait out its delay once the run is being stopped
+        if (cancel_requested())
+        {
+            auto sleeping = std::partition(timers.begin(), timers.end(), [](const Timer &timer) { return timer.expires != nullptr; });
+            for (auto it = sleeping; it != timers.end(); ++it)
+            {
+                resumable.push_back(it->waiter);
+            }
+            timers.erase(sleeping, timers.end());
+            std::make_heap(timers.begin(), timers.end(), std::greater<Timer>());
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        while (!timers.empty() && timers.front().when <= now)
+        {
+            std::pop_heap(timers.begin(), timers.end(), std::greater<Timer>());
+            Timer timer = timers.back();
+            timers.pop_back();
+
+            if (!timer.expires)
+            {
+                resumable.push_back(timer.waiter);
+                continue;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(shared->mutex);
+                if (!timer.expires->finished)
+                {
+                    timer.expires->abandoned = true;
+                    resumable.push_back(timer.expires->waiter);
+                    shared->live_threads--;
+                    start_thread();
+                }
+            }
+            timer.expires->release();
+        }
+    }
+
+    // Called with the mutex held
+    void start_thread()
+    {
+        shared->live_threads++;
+        std::thread(loop, shared, shared->started_threads++).detach();
+    }
+
+    static void loop(std::shared_ptr<Shared> shared, size_t ordinal)
+    {
+        pin_worker(ordinal);
+        std::unique_lock<std::mutex> lock(shared->mutex);
+        while (true)
+        {
+            shared->work.wait(lock, [&]() { return !shared->queue.empty() || shared->stop; });
+            if (shared->queue.empty())
+            {
+                break;
+            }
+
+            Operation *operation = shared->queue.front();
+            shared->queue.pop_front();
+            lock.unlock();
+            operation->execute();
+            lock.lock();
+
+            // An abandoned thread has been replaced already, it just leaves
+            bool abandoned = operation->abandoned;
+            if (!abandoned)
+            {
+                operation->finished = true;
+                shared->ready.push_back(operation->waiter);
+                shared->wake.notify_one();
+            }
+            operation->release();
+            if (abandoned)
+            {
+                return;
+            }
+        }
+        shared->live_threads--;
+        shared->exited.notify_all();
+    }
+
+    void finished(std::exception_ptr task_error)
+    {
+        tasks--;
+        if (task_error && !error)
+        {
+            error = task_error;
+        }
+    }
+
+    std::shared_ptr<Shared> shared;
+    bool inline_calls;
+    std::vector<Timer> timers; // min-heap, only touched by run()
+    size_t tasks = 0;
+    std::exception_ptr error;
+};
+
+std::coroutine_handle<> Task::FinalAwaiter::await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+{
+    promise_type &promise = handle.promise();
+    if (promise.continuation)
+    {
+        return promise.continuation;
+    }
+
+    // Detached, nobody will await the result
+    promise.owner->finished(promise.error);
+    handle.destroy();
+    return std::noop_coroutine();
+}
+
+// Free pipeline slots. Only used from the loop thread. Waiters (the dispatcher
+// and pipelines back from a retry delay) get freed slots in arrival order
+class Slots
+{
+public:
+    Slots(Executor &executor, size_t count) : executor(executor), available(count)
+    {
+    }
+
+    struct [[nodiscard]] Acquire
+    {
+        Slots &slots;
+
+        bool await_ready() noexcept
+        {
+            if (slots.available == 0)
+            {
+                return false;
+            }
+            slots.available--;
+            return true;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            slots.waiters.push_back(handle);
+        }
+
+        void await_resume() noexcept
+        {
+        }
+    };
+
+    Acquire acquire()
+    {
+        return {*this};
+    }
+
+    // Hands the slot straight to the first waiter if there is one
+    void release()
+    {
+        if (!waiters.empty())
+        {
+            executor.post(waiters.front());
+            waiters.pop_front();
+        }
+        else
+        {
+            available++;
+        }
+    }
+
+private:
+    Executor &executor;
+    size_t available;
+    Fifo<std::coroutine_handle<>> waiters;
+};
+
+// Raise the soft open file limit to the hard one and split it between the fd
+// pool and targets held open, leaving the rest for everything else
+void apply_fd_limit(Options &options)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+    {
+        return;
+    }
+    if (limit.rlim_cur < limit.rlim_max)
+    {
+        rlim_t wanted = limit.rlim_max;
+        limit.rlim_cur = wanted;
+        if (setrlimit(RLIMIT_NOFILE, &limit) != 0)
+        {
+            getrlimit(RLIMIT_NOFILE, &limit);
+        }
+    }
+
+    uint64_t available = limit.rlim_cur == RLIM_INFINITY ? UINT64_MAX : static_cast<uint64_t>(limit.rlim_cur);
+    options.pooled_fds = static_cast<size_t>(std::clamp<uint64_t>(available / 8, 4, 256));
+    options.held_fds = static_cast<size_t>(std::clamp<uint64_t>(available / 2, 8, 65536));
+}
+
+// Read-only fds of sources and clone sources, the least recently used one is
+// closed when the pool is full. Fds in use by a pipeline are pinned and never
+// evicted, the pool grows past its capacity if all are. Small enough that a
+// linear search beats a map
+class FdPool
+{
+public:
+    FdPool(Backend &backend, size_t capacity) : backend(backend), capacity(capacity)
+    {
+        entries.reserve(capacity);
+    }
+
+    FdPool(const FdPool &) = delete;
+    FdPool &operator=(const FdPool &) = delete;
+
+    ~FdPool()
+    {
+        for (auto &entry : entries)
+        {
+            backend.close(entry.handle.fd);
+        }
+    }
+
+    // Pinned until release, null if the key isn't open
+    const SourceHandle *acquire(uint64_t key)
+    {
+        for (auto &entry : entries)
+        {
+            if (entry.key == key)
+            {
+                entry.last_use = ++tick;
+                entry.pins++;
+                return &entry.handle;
+            }
+        }
+        return nullptr;
+    }
+
+    // Adds a newly opened fd, pinned. If another pipeline opened the same key
+    // meanwhile, the new fd is closed and the pooled one returned
+    SourceHandle insert(uint64_t key, SourceHandle handle)
+    {
+        if (const SourceHandle *existing = acquire(key))
+        {
+            backend.close(handle.fd);
+            return *existing;
+        }
+
+        if (entries.size() >= capacity)
+        {
+            auto oldest = entries.end();
+            for (auto it = entries.begin(); it != entries.end(); ++it)
+            {
+                if (it->pins == 0 && (oldest == entries.end() || it->last_use < oldest->last_use))
+                {
+                    oldest = it;
+                }
+            }
+            if (oldest != entries.end())
+            {
+                backend.close(oldest->handle.fd);
+                *oldest = entries.back();
+                entries.pop_back();
+            }
+        }
+        entries.push_back({key, handle, ++tick, 1});
+        return handle;
+    }
+
+    // Fds no longer in the pool (forgotten) are ignored
+    void release(int fd)
+    {
+        if (Entry *entry = find_fd(fd))
+        {
+            entry->pins--;
+        }
+    }
+
+    // An fd still used by an abandoned call is dropped without closing it
+    void forget(int fd)
+    {
+        if (Entry *entry = find_fd(fd))
+        {
+            *entry = entries.back();
+            entries.pop_back();
+        }
+    }
+
+private:
+    struct Entry
+    {
+        uint64_t key;
+        SourceHandle handle;
+        uint64_t last_use;
+        unsigned pins;
+    };
+
+    Entry *find_fd(int fd)
+    {
+        if (fd < 0)
+        {
+            return nullptr;
+        }
+        for (auto &entry : entries)
+        {
+            if (entry.handle.fd == fd)
+            {
+                return &entry;
+            }
+        }
+        return nullptr;
+    }
+
+    Backend &backend;
+    size_t capacity;
+    std::vector<Entry> entries;
+    uint64_t tick = 0;
+};
+
+// Pool keys of clone sources, sources use their plan index
+constexpr uint64_t CLONE_KEY = 1ull << 63;
+
+// Net growth of one file system if the plan runs
+struct SpaceDelta
+{
+    uint64_t device;
+    const char *sample_path; // any target on the file system, for statvfs
+    int64_t bytes;
+};
+
+// Refuse the run before anything is written if a file system would run out of
+// space or quota. Targets before start were written by an earlier run. Growth
+// is counted per file system as the assigned source size minus the current
+// target size. Clones are counted as full writes since extent sharing is only
+// known once the first clone succeeds. Without symlinks every target is on the
+// destination's file system, and when all source bytes fit there the targets
+// don't need a stat each
+void check_space(Backend &backend, const Plan &plan, size_t start)
+{
+    if (start < plan.targets.size() && plan.linked_targets == 0)
+    {
+        uint64_t total = 0;
+        for (size_t i = start; i < plan.targets.size(); i++)
+        {
+            total += plan.source_sizes[source_index_for(plan, i)];
+        }
+        if (total <= backend.available_space(plan.targets[start]))
+        {
+            return;
+        }
+    }
+
+    std::vector<SpaceDelta> deltas;
+
+    for (size_t i = start; i < plan.targets.size(); i++)
+    {
+        FileStatus status = backend.stat(plan.targets[i]);
+        int64_t delta = static_cast<int64_t>(plan.source_sizes[source_index_for(plan, i)]) - static_cast<int64_t>(status.size);
+
+        auto it = std::find_if(deltas.begin(), deltas.end(), [&](const SpaceDelta &d) { return d.device == status.device; });
+        if (it == deltas.end())
+        {
+            deltas.push_back({status.device, plan.targets[i], delta});
+        }
+        else
+        {
+            it->bytes += delta;
+        }
+    }
+
+    for (const auto &delta : deltas)
+    {
+        if (delta.bytes <= 0)
+        {
+            continue;
+        }
+
+        uint64_t available = backend.available_space(delta.sample_path);
+        if (static_cast<uint64_t>(delta.bytes) > available)
+        {
+            throw std::runtime_error("Not enough space for " + std::string(delta.sample_path) + " and the other targets on its file system: " + std::to_string(delta.bytes) + " more bytes needed, " + std::to_string(available) + " available");
+        }
+    }
+}
+
+// Bytes the plan writes, from the source sizes seen while scanning
+uint64_t planned_bytes(const Plan &plan)
+{
+    if (!plan.selected.empty())
+    {
+        uint64_t total = 0;
+        for (size_t i = 0; i < plan.targets.size(); i++)
+        {
+            total += plan.source_sizes[source_index_for(plan, i)];
+        }
+        return total;
+    }
+
+    size_t src_count = plan.sources.size();
+    size_t base_count = plan.targets.size() / src_count;
+    size_t remainder = plan.targets.size() % src_count;
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < src_count; i++)
+    {
+        total += plan.source_sizes[i] * (base_count + (i < remainder ? 1 : 0));
+    }
+    return total;
+}
+
+// Compressed sources are planned with their size on disk until the index has
+// decompressed them. Returns whether any size changed
+bool apply_indexed_sizes(Plan &plan, const SourceIndex &index)
+{
+    bool changed = false;
+    for (size_t i = 0; i < index.content_of.size(); i++)
+    {
+        uint64_t size = index.contents[index.content_of[i]].size;
+        changed |= plan.source_sizes[i] != size;
+        plan.source_sizes[i] = size;
+    }
+    return changed;
+}
+
+// Terminal switched to unbuffered input and the alternate screen while the plan
+// browser runs. Ctrl-C still raises SIGINT and ends the browser through cancel_requested()
+class RawTerminal
+{
+public:
+    RawTerminal()
+    {
+        fd = open("/dev/tty", O_RDWR | O_CLOEXEC);
+        if (fd < 0 || tcgetattr(fd, &saved) != 0)
+        {
+            if (fd >= 0)
+            {
+                ::close(fd);
+            }
+            throw std::runtime_error("--browse needs a terminal");
+        }
+
+        termios raw = saved;
+        raw.c_lflag &= ~(ICANON | ECHO);
+        raw.c_iflag &= ~(IXON | ICRNL);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(fd, TCSANOW, &raw);
+        write("\x1b[?1049h\x1b[?25l");
+    }
+
+    RawTerminal(const RawTerminal &) = delete;
+    RawTerminal &operator=(const RawTerminal &) = delete;
+
+    ~RawTerminal()
+    {
+        write("\x1b[?25h\x1b[?1049l");
+        tcsetattr(fd, TCSANOW, &saved);
+        ::close(fd);
+    }
+
+    // Rows and columns, re-read every frame so resizing just works
+    std::pair<size_t, size_t> size() const
+    {
+        winsize window{};
+        if (ioctl(fd, TIOCGWINSZ, &window) != 0 || window.ws_row == 0 || window.ws_col == 0)
+        {
+            return {24, 80};
+        }
+        return {window.ws_row, window.ws_col};
+    }
+
+    void write(sv text)
+    {
+        while (!text.empty())
+        {
+            ssize_t n = ::write(fd, text.data(), text.size());
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                return;
+            }
+            text.remove_prefix(n);
+        }
+    }
+
+    // Bytes of one key press, empty when interrupted by a signal. Keys typed
+    // ahead arrive in one read and are handed out one at a time
+    std::string read_key()
+    {
+        if (pending.empty())
+        {
+            char input[64];
+            ssize_t n = ::read(fd, input, sizeof(input));
+            if (n <= 0)
+            {
+                return {};
+            }
+            pending.assign(input, n);
+        }
+
+        size_t length = 1;
+        unsigned char lead = pending[0];
+        if (lead == 0x1B && pending.size() > 1 && pending[1] == '[')
+        {
+            // CSI sequence, ends with a byte from @ to ~
+            length = 2;
+            while (length < pending.size() && (pending[length] < 0x40 || pending[length] > 0x7E))
+            {
+                length++;
+            }
+            length = std::min(length + 1, pending.size());
+        }
+        else if (lead >= 0xC0)
+        {
+            length = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : 2;
+            length = std::min(length, pending.size());
+        }
+
+        std::string key = pending.substr(0, length);
+        pending.erase(0, length);
+        return key;
+    }
+
+private:
+    int fd = -1;
+    termios saved{};
+    std::string pending; // bytes read but not handed out yet
+};
+
+// Append text cut to width columns, never splitting a UTF-8 sequence
+void append_clipped(std::string &out, sv text, size_t width)
+{
+    if (text.size() > width)
+    {
+        size_t end = width;
+        while (end > 0 && (static_cast<unsigned char>(text[end]) & 0xC0) == 0x80)
+        {
+            end--;
+        }
+        text = text.substr(0, end);
+    }
+    out.append(text);
+}
+
+// Interactive review of the plan before anything is written. Only the visible
+// rows are rendered, so paging is instant at any size. Targets can be listed by
+// source, filtered by a substring of the target or source path and excluded
+// from the run. Returns false if the user quit, keep marks the targets to write
+bool browse_plan(const Plan &plan, std::vector<bool> &keep)
+{
+    size_t count = plan.targets.size();
+    keep.assign(count, true);
+    size_t excluded = 0;
+    uint64_t excluded_bytes = 0;
+    uint64_t total_bytes = planned_bytes(plan);
+
+    // Row order: plan order, or targets grouped by source. A filter narrows it further.
+    // Empty vectors stand for plan order and keep the default free for huge plans
+    std::vector<uint64_t> grouped;
+    std::vector<uint64_t> filtered;
+    bool by_source = false;
+    std::string filter;
+
+    auto charged = [](std::vector<uint64_t> &rows, std::vector<uint64_t> &&next)
+    {
+        memory_budget.release(rows.size() * sizeof(uint64_t));
+        rows.clear();
+        rows.shrink_to_fit();
+        memory_budget.reserve(next.size() * sizeof(uint64_t), "the plan browser");
+        rows = std::move(next);
+    };
+    auto ordered = [&](size_t row) -> uint64_t
+    {
+        return grouped.empty() ? row : grouped[row];
+    };
+    auto target_at = [&](size_t row) -> uint64_t
+    {
+        return filter.empty() ? ordered(row) : filtered[row];
+    };
+    auto row_count = [&]() -> size_t
+    {
+        return filter.empty() ? count : filtered.size();
+    };
+
+    // Counting sort keeps plan order within each source
+    auto group_by_source = [&]()
+    {
+        std::vector<uint64_t> starts(plan.sources.size() + 1, 0);
+        for (size_t i = 0; i < count; i++)
+        {
+            starts[source_index_for(plan, i) + 1]++;
+        }
+        for (size_t s = 1; s < starts.size(); s++)
+        {
+            starts[s] += starts[s - 1];
+        }
+        std::vector<uint64_t> rows(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            rows[starts[source_index_for(plan, i)]++] = i;
+        }
+        charged(grouped, std::move(rows));
+    };
+
+    auto apply_filter = [&]()
+    {
+        std::vector<uint64_t> rows;
+        if (!filter.empty())
+        {
+            for (size_t row = 0; row < count; row++)
+            {
+                uint64_t i = ordered(row);
+                if (sv(plan.targets[i]).find(filter) != sv::npos || sv(plan.sources[source_index_for(plan, i)]).find(filter) != sv::npos)
+                {
+                    rows.push_back(i);
+                }
+            }
+        }
+        charged(filtered, std::move(rows));
+    };
+
+    auto toggle = [&](uint64_t i, bool include)
+    {
+        if (keep[i] == include)
+        {
+            return;
+        }
+        keep[i] = include;
+        uint64_t bytes = plan.source_sizes[source_index_for(plan, i)];
+        if (include)
+        {
+            excluded--;
+            excluded_bytes -= bytes;
+        }
+        else
+        {
+            excluded++;
+            excluded_bytes += bytes;
+        }
+    };
+
+    RawTerminal terminal;
+    size_t current = 0;
+    size_t top = 0;
+    bool typing = false; // the filter line has focus
+    std::string edit;
+    std::string message;
+    std::string frame;
+    size_t number_width = std::to_string(count).size();
+
+    while (!cancel_requested())
+    {
+        auto [height, width] = terminal.size();
+        size_t page = height > 2 ? height - 2 : 1;
+        size_t rows = row_count();
+        current = rows == 0 ? 0 : std::min(current, rows - 1);
+        top = std::min(top, current);
+        top = current >= top + page ? current - page + 1 : top;
+
+        frame.assign("\x1b[H");
+        std::string header = "Targets " + std::to_string(count - excluded) + " of " + std::to_string(count) + ", " + std::to_string(total_bytes - excluded_bytes) + " bytes";
+        header += by_source ? ", by source" : ", plan order";
+        if (!filter.empty())
+        {
+            header += ", filter \"" + filter + "\": " + std::to_string(rows) + " rows";
+        }
+        frame += "\x1b[1m";
+        append_clipped(frame, header, width);
+        frame += "\x1b[0m\x1b[K\r\n";
+
+        for (size_t line = 0; line < page; line++)
+        {
+            size_t row = top + line;
+            if (row < rows)
+            {
+                uint64_t i = target_at(row);
+                std::string number = std::to_string(i + 1);
+                std::string text = keep[i] ? "  " : "- ";
+                text.append(number_width - number.size(), ' ');
+                text += number;
+                text += "  ";
+                text += plan.targets[i];
+                text += "  <- ";
+                text += filename_of(plan.sources[source_index_for(plan, i)]);
+
+                frame += row == current ? "\x1b[7m" : keep[i] ? "" : "\x1b[2m";
+                append_clipped(frame, text, width);
+                frame += "\x1b[0m";
+            }
+            frame += "\x1b[K\r\n";
+        }
+
+        std::string footer;
+        if (typing)
+        {
+            footer = "Filter: " + edit;
+        }
+        else if (!message.empty())
+        {
+            footer = message;
+        }
+        else
+        {
+            footer = "arrows/PgUp/PgDn/Home/End move, / filter, s by source, space toggle, x/i exclude/include rows, Enter continue, q quit";
+        }
+        append_clipped(frame, footer, width);
+        frame += "\x1b[K";
+        terminal.write(frame);
+        message.clear();
+
+        std::string key = terminal.read_key();
+        if (key.empty())
+        {
+            continue;
+        }
+
+        if (typing)
+        {
+            if (key == "\r" || key == "\n")
+            {
+                typing = false;
+                filter = edit;
+                apply_filter();
+                current = 0;
+            }
+            else if (key == "\x1b")
+            {
+                typing = false;
+            }
+            else if (key == "\x7f" || key == "\b")
+            {
+                if (!edit.empty())
+                {
+                    edit.pop_back();
+                }
+            }
+            else if (static_cast<unsigned char>(key[0]) >= ' ')
+            {
+                edit.append(key);
+            }
+            continue;
+        }
+
+        if (key == "\x1b[A" || key == "k")
+        {
+            current = current > 0 ? current - 1 : 0;
+        }
+        else if (key == "\x1b[B" || key == "j")
+        {
+            current++;
+        }
+        else if (key == "\x1b[5~")
+        {
+            current = current > page ? current - page : 0;
+        }
+        else if (key == "\x1b[6~")
+        {
+            current += page;
+        }
+        else if (key == "\x1b[H" || key == "\x1b[1~" || key == "g")
+        {
+            current = 0;
+        }
+        else if (key == "\x1b[F" || key == "\x1b[4~" || key == "G")
+        {
+            current = rows > 0 ? rows - 1 : 0;
+        }
+        else if (key == "/")
+        {
+            typing = true;
+            edit = filter;
+        }
+        else if (key == "s")
+        {
+            uint64_t at = rows > 0 ? target_at(current) : 0;
+            by_source = !by_source;
+            if (by_source)
+            {
+                group_by_source();
+            }
+            else
+            {
+                charged(grouped, {});
+            }
+            apply_filter();
+
+            // Stay on the same target
+            current = 0;
+            for (size_t row = 0; row < row_count(); row++)
+            {
+                if (target_at(row) == at)
+                {
+                    current = row;
+                    break;
+                }
+            }
+        }
+        else if (key == " " && rows > 0)
+        {
+            uint64_t i = target_at(current);
+            toggle(i, !keep[i]);
+            current++;
+        }
+        else if (key == "x" || key == "i")
+        {
+            for (size_t row = 0; row < rows; row++)
+            {
+                toggle(target_at(row), key == "i");
+            }
+        }
+        else if (key == "\r" || key == "\n")
+        {
+            if (excluded == count)
+            {
+                message = "Every target is excluded, include some or press q to quit";
+                continue;
+            }
+            break;
+        }
+        else if (key == "q")
+        {
+            charged(grouped, {});
+            charged(filtered, {});
+            return false;
+        }
+    }
+
+    charged(grouped, {});
+    charged(filtered, {});
+    return true;
+}
+
+// Where a limited run stopped, so the next one can pick up from there
+struct Cursor
+{
+    uint64_t plan = 0; // fingerprint of the plan it belongs to
+    uint64_t position = 0;
+    std::optional<uint64_t> seed; // of --distribute random
+    bool loaded = false;
+};
+
+// Identifies a plan by its sources, targets and their assignment
+uint64_t plan_fingerprint(const Plan &plan, const Options &options)
+{
+    ContentHasher hasher;
+    if (plan.shuffle)
+    {
+        uint64_t seed = *options.seed;
+        hasher.update(&seed, sizeof(seed));
+    }
+    for (size_t i = 0; i < plan.sources.size(); i++)
+    {
+        hasher.update(plan.sources[i], std::strlen(plan.sources[i]) + 1);
+    }
+    hasher.update("\0", 1);
+    for (size_t i = 0; i < plan.targets.size(); i++)
+    {
+        hasher.update(plan.targets[i], std::strlen(plan.targets[i]) + 1);
+    }
+    // With --targets-from the assignment also depends on where the kept targets were
+    if (!plan.selected.empty())
+    {
+        hasher.update(&plan.assigned_targets, sizeof(plan.assigned_targets));
+        hasher.update(plan.selected.data(), plan.selected.size() * sizeof(uint64_t));
+    }
+    return hasher.finish();
+}
+
+// A missing file is a fresh start
+Cursor load_cursor(const std::string &path)
+{
+    Cursor cursor;
+    std::ifstream in(path);
+    if (!in)
+    {
+        if (errno == ENOENT)
+        {
+            return cursor;
+        }
+        throw std::runtime_error("Failed to open cursor file: " + path);
+    }
+
+    std::string key;
+    bool has_plan = false;
+    bool has_position = false;
+    while (in >> key)
+    {
+        if (key[0] == '#')
+        {
+            std::getline(in, key);
+        }
+        else if (key == "plan")
+        {
+            has_plan = static_cast<bool>(in >> std::hex >> cursor.plan >> std::dec);
+        }
+        else if (key == "position")
+        {
+            has_position = static_cast<bool>(in >> cursor.position);
+        }
+        else if (key == "seed")
+        {
+            uint64_t seed;
+            if (!(in >> seed))
+            {
+                break;
+            }
+            cursor.seed = seed;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (!has_plan || !has_position)
+    {
+        throw std::runtime_error("Invalid cursor file: " + path);
+    }
+    cursor.loaded = true;
+    return cursor;
+}
+
+// Written next to the old cursor and renamed over it, an interrupted save leaves the old one
+void save_cursor(const std::string &path, const Cursor &cursor)
+{
+    write_file_atomically(path, "cursor file", [&](std::ostream &out)
+    {
+        out << "# xreplace cursor, delete it to start the plan over\n";
+        out << "plan " << std::hex << std::setw(16) << std::setfill('0') << cursor.plan << std::dec << "\n";
+        out << "position " << cursor.position << "\n";
+        if (cursor.seed)
+        {
+            out << "seed " << *cursor.seed << "\n";
+        }
+    });
+}
+
+// Errors that usually clear up on their own, e.g. a game client or virus scanner holding the file
+bool is_transient_error(int error)
+{
+    return error == EBUSY || error == ETXTBSY || error == EAGAIN || error == EINTR || error == ESTALE;
+}
+
+// Jittered exponential backoff, uniform between half the base and min(cap, base * 2^attempt)
+std::chrono::milliseconds retry_delay(unsigned attempt, std::mt19937 &rng)
+{
+    constexpr uint64_t BASE_MS = 100;
+    constexpr uint64_t CAP_MS = 10000;
+    uint64_t ceiling = std::min<uint64_t>(CAP_MS, BASE_MS << std::min(attempt, 16u));
+    return std::chrono::milliseconds(std::uniform_int_distribution<uint64_t>(BASE_MS / 2, std::max(BASE_MS / 2, ceiling))(rng));
+}
+
+// Whether each target is confirmed on stdin before it is started
+struct NoConfirm
+{
+    static constexpr bool SERIAL = false;
+
+    static bool approve(const char *)
+    {
+        return true;
+    }
+};
+
+struct ConfirmEach
+{
+    static constexpr bool SERIAL = true; // prompts only make sense one target at a time
+
+    // False once the run is being stopped
+    static bool approve(const char *dest_path)
+    {
+        std::cout << "Target: " << std::quoted(filename_of(dest_path)) << "\n";
+        confirm_overwrite();
+        return !cancel_requested();
+    }
+};
+
+// Whether --deadline, --max-bytes or --max-files are checked before each target
+struct Unlimited
+{
+    static constexpr bool LIMITED = false;
+};
+
+struct Limited
+{
+    static constexpr bool LIMITED = true;
+};
+
+// Write targets from position on, up to --jobs at a time. Leaves position at the
+// target to resume from, the end of the plan unless a limit, a signal or an error
+// stopped the run early. It is set before an error is rethrown too
+template <typename BackendT, typename Confirm, typename Durability, typename Limits>
+void write_targets(BackendT &backend, const Plan &plan, SourceIndex &index, RunStats &stats, const Options &options, size_t &position)
+{
+    // Sources stay open across their block of targets and across retries of earlier ones
+    FdPool pool(backend, options.pooled_fds);
+
+    size_t jobs = Confirm::SERIAL ? 1 : options.jobs;
+    Executor executor(jobs == 1 && options.target_timeout.count() == 0 ? 0 : jobs);
+    Slots slots(executor, jobs);
+    std::mt19937 rng(std::random_device{}());
+
+    // Limits only hold back new targets, the ones already started are finished
+    uint64_t dispatched_files = 0;
+    uint64_t dispatched_bytes = 0;
+    auto deadline = options.started + options.deadline;
+    auto limit_reached = [&](size_t i)
+    {
+        if (options.max_files > 0 && dispatched_files >= options.max_files)
+            return true;
+        if (options.max_bytes > 0 && dispatched_files > 0 && dispatched_bytes + plan.source_sizes[source_index_for(plan, i)] > options.max_bytes)
+            return true;
+        return options.deadline.count() > 0 && std::chrono::steady_clock::now() >= deadline;
+    };
+
+    size_t resume = SIZE_MAX; // earliest target a pipeline gave up on without a result
+    std::exception_ptr error; // first fatal error, stops dispatching
+
+    // One target from open to close. Transient errors are retried after a delay,
+    // during which the pipeline holds neither its slot nor fds, so other targets
+    // start meanwhile
+    auto pipeline = [&](size_t i) -> Task
+    {
+        const char *dest_path = plan.targets[i];
+
+        // Identical sources share the entry of the first one
+        size_t src_index = source_index_for(plan, i);
+        ContentEntry *content = nullptr;
+        if (!index.content_of.empty())
+        {
+            content = &index.contents[index.content_of[src_index]];
+            src_index = content->source;
+        }
+        bool cached = content && content->cached;
+        uint64_t key = cached ? CLONE_KEY | index.content_of[source_index_for(plan, i)] : src_index;
+
+        for (unsigned attempt = 0;; attempt++)
+        {
+            int pinned = -1;
+            bool retry = false;
+            try
+            {
+                // Hung writes hold their fds until they return, stop before they use up the limit
+                if (stats.timed_out_files * 2 >= options.held_fds)
+                {
+                    throw std::runtime_error("Too many targets stuck on a hung file system (" + std::to_string(stats.timed_out_files) + "), stopping");
+                }
+
+                TargetJob job;
+                job.backend = &backend;
+                job.dest_path = dest_path;
+                if (cached)
+                {
+                    const SourceHandle *clone_source = content->clone_unavailable ? nullptr : pool.acquire(key);
+                    pinned = clone_source ? clone_source->fd : -1;
+                    job.contents = &content->data;
+                    job.clone_fd = clone_source ? clone_source->fd : content->clone_unavailable ? CLONE_UNAVAILABLE : CLONE_PENDING;
+                }
+                else
+                {
+                    const SourceHandle *src = pool.acquire(key);
+                    job.src = src ? *src : pool.insert(key, backend.open_source(source_path(plan, src_index, content)));
+                    job.clone_src = content && !content->stored.empty() && !content->clone_unavailable;
+                    pinned = job.src.fd;
+                }
+
+                auto started = std::chrono::steady_clock::now();
+                job = co_await executor.blocking([job]() mutable
+                {
+                    run_target_job<BackendT, Durability>(job);
+                    return job;
+                }, options.target_timeout);
+                pool.release(pinned);
+                pinned = -1;
+
+                if (cached)
+                {
+                    stats.cloned_files += job.cloned ? 1 : 0;
+                    if (job.clone_failed)
+                    {
+                        content->clone_unavailable = true;
+                    }
+                    else if (job.clone_fd == CLONE_PENDING && job.written_fd >= 0)
+                    {
+                        // insert may hand back an entry another pipeline added and close written_fd
+                        pool.release(pool.insert(key, {job.written_fd, job.bytes, dest_path}).fd);
+                    }
+                    else if (job.clone_fd == CLONE_PENDING)
+                    {
+                        content->clone_unavailable = true;
+                    }
+                }
+                else if (job.clone_src)
+                {
+                    stats.cloned_files += job.cloned ? 1 : 0;
+                    content->clone_unavailable = job.clone_failed;
+                }
+
+                stats.written_bytes += job.bytes;
+                stats.record_target(i, source_index_for(plan, i), std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+                stats.overwritten_files++;
+            }
+            catch (const TimeoutError &)
+            {
+                // The abandoned call keeps using its fds, so they are never closed or reused
+                pool.forget(pinned);
+                stats.failed_files++;
+                stats.timed_out_files++;
+                std::cerr << "ERROR: Timed out writing " << dest_path << "\n";
+            }
+            catch (const std::system_error &e)
+            {
+                pool.release(pinned);
+                if (attempt < options.retries && is_transient_error(e.code().value()))
+                {
+                    retry = true;
+                }
+                else
+                {
+                    stats.failed_files++;
+                    error = error ? error : std::current_exception();
+                    resume = std::min(resume, i);
+                }
+            }
+            catch (...)
+            {
+                pool.release(pinned);
+                stats.failed_files++;
+                error = error ? error : std::current_exception();
+                resume = std::min(resume, i);
+            }
+
+            if (!retry)
+            {
+                break;
+            }
+
+            stats.retried_files++;
+            auto ready = std::chrono::steady_clock::now() + retry_delay(attempt, rng);
+            if (options.deadline.count() > 0 && ready > deadline)
+            {
+                resume = std::min(resume, i);
+                break;
+            }
+            slots.release();
+            co_await executor.sleep_until(ready);
+            co_await slots.acquire();
+            if (cancel_requested() || error)
+            {
+                resume = std::min(resume, i);
+                break;
+            }
+        }
+
+        slots.release();
+    };
+
+    size_t next = position;
+    auto dispatch = [&]() -> Task
+    {
+        for (; next < plan.targets.size(); next++)
+        {
+            co_await slots.acquire();
+            if (cancel_requested() || error)
+            {
+                break;
+            }
+
+            if (!Confirm::approve(plan.targets[next]))
+            {
+                break;
+            }
+
+            if constexpr (Limits::LIMITED)
+            {
+                if (limit_reached(next))
+                {
+                    break;
+                }
+                dispatched_files++;
+                dispatched_bytes += plan.source_sizes[source_index_for(plan, next)];
+            }
+
+            executor.spawn(pipeline(next));
+        }
+    };
+
+    executor.spawn(dispatch());
+    executor.run();
+
+    position = std::min(next, resume);
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}
+
+template <typename BackendT, typename Confirm, typename Durability>
+void write_with_limits(BackendT &backend, const Plan &plan, SourceIndex &index, RunStats &stats, const Options &options, size_t &position)
+{
+    if (options.limited())
+    {
+        write_targets<BackendT, Confirm, Durability, Limited>(backend, plan, index, stats, options, position);
+        return;
+    }
+    write_targets<BackendT, Confirm, Durability, Unlimited>(backend, plan, index, stats, options, position);
+}
+
+template <typename BackendT, typename Confirm>
+void write_with_durability(BackendT &backend, const Plan &plan, SourceIndex &index, RunStats &stats, const Options &options, const uint64_t flags, size_t &position)
+{
+    if (flags & Flags::SYNC)
+    {
+        write_with_limits<BackendT, Confirm, SyncEach>(backend, plan, index, stats, options, position);
+        return;
+    }
+    write_with_limits<BackendT, Confirm, NoSync>(backend, plan, index, stats, options, position);
+}
+
+template <typename BackendT>
+void write_with_confirm(BackendT &backend, const Plan &plan, SourceIndex &index, RunStats &stats, const Options &options, const uint64_t flags, size_t &position)
+{
+    if (flags & Flags::CONFIRM_EACH)
+    {
+        write_with_durability<BackendT, ConfirmEach>(backend, plan, index, stats, options, flags, position);
+        return;
+    }
+    write_with_durability<BackendT, NoConfirm>(backend, plan, index, stats, options, flags, position);
+}
+
+// Pick the write loop for this run's backend and modes once, each combination
+// is its own instantiation of write_targets without per-target mode checks
+void perform_write(Backend &backend, const Plan &plan, SourceIndex &index, RunStats &stats, const Options &options, const uint64_t flags, size_t &position)
+{
+    stats.source_latency.assign(plan.sources.size(), {});
+    if (auto *posix = dynamic_cast<PosixBackend *>(&backend))
+    {
+        write_with_confirm(*posix, plan, index, stats, options, flags, position);
+        return;
+    }
+    write_with_confirm(dynamic_cast<MemoryBackend &>(backend), plan, index, stats, options, flags, position);
+}
+
+// Targets handed to a single FIDEDUPERANGE call, keeps the request within a page
+constexpr size_t DEDUPE_BATCH = 64;
+
+// Targets waiting to be deduplicated against one content entry
+struct DedupeBatch
+{
+    std::vector<int> fds;
+    std::vector<const char *> paths;
+};
+
+void flush_dedupe_batch(Backend &backend, const Plan &plan, const ContentEntry &content, DedupeBatch &batch, RunStats &stats)
+{
+    if (batch.fds.empty())
+    {
+        return;
+    }
+
+    bool deduped[DEDUPE_BATCH];
+    try
+    {
+        SourceHandle src = backend.open_source(source_path(plan, content.source, &content));
+        try
+        {
+            backend.dedupe(src, batch.fds.data(), batch.fds.size(), deduped);
+        }
+        catch (...)
+        {
+            backend.close(src.fd);
+            throw;
+        }
+        backend.close(src.fd);
+    }
+    catch (...)
+    {
+        for (int fd : batch.fds)
+        {
+            backend.close(fd);
+        }
+        batch.fds.clear();
+        batch.paths.clear();
+        throw;
+    }
+
+    for (size_t i = 0; i < batch.fds.size(); i++)
+    {
+        if (deduped[i])
+        {
+            stats.deduped_files++;
+            stats.deduped_bytes += content.size;
+        }
+        backend.close(batch.fds[i]);
+    }
+    batch.fds.clear();
+    batch.paths.clear();
+}
+
+// Whether a target already holds the given contents: size first, then the
+// cached bytes chunk by chunk, or the hash where the source is not cached
+bool holds_contents(Backend &backend, const SourceHandle &target, const ContentEntry &content, Slab &buffer)
+{
+    if (target.size != content.size)
+    {
+        return false;
+    }
+    if (!content.cached)
+    {
+        uint64_t size = 0;
+        return hash_file(backend, target, buffer, size) == content.hash && size == content.size;
+    }
+
+    uint64_t offset = 0;
+    while (uint64_t n = backend.read(target, buffer.data(), buffer.size(), offset))
+    {
+        if (offset + n > content.size || std::memcmp(buffer.data(), content.data.data() + offset, n) != 0)
+        {
+            return false;
+        }
+        offset += n;
+    }
+    return offset == content.size;
+}
+
+// Find targets that already hold their assigned source's contents (size, then hash)
+// and let them share the source's extents. Nothing is rewritten
+void perform_dedupe(Backend &backend, const Plan &plan, const SourceIndex &index, RunStats &stats, const Options &options)
+{
+    size_t held = 0; // target fds waiting in batches
+    std::vector<DedupeBatch> batches(index.contents.size());
+    Slab &buffer = thread_slab();
+
+    try
+    {
+        for (size_t i = 0; i < plan.targets.size() && !cancel_requested(); i++)
+        {
+            const char *dest_path = plan.targets[i];
+            uint32_t content_index = index.content_of[source_index_for(plan, i)];
+            const ContentEntry &content = index.contents[content_index];
+
+            SourceHandle target = backend.open_existing(dest_path);
+            bool same = false;
+            try
+            {
+                // A compressed source has no extents holding its contents to share, its store object does
+                same = content.size > 0 && (!content.compressed || !content.stored.empty()) && holds_contents(backend, target, content, buffer);
+            }
+            catch (...)
+            {
+                backend.close(target.fd);
+                throw;
+            }
+
+            if (!same)
+            {
+                backend.close(target.fd);
+                continue;
+            }
+
+            DedupeBatch &batch = batches[content_index];
+            batch.fds.push_back(target.fd);
+            batch.paths.push_back(dest_path);
+            held++;
+            if (batch.fds.size() == DEDUPE_BATCH)
+            {
+                held -= batch.fds.size();
+                flush_dedupe_batch(backend, plan, content, batch, stats);
+            }
+
+            // Many distinct contents would otherwise keep a partial batch open each
+            if (held >= options.held_fds)
+            {
+                auto fullest = std::max_element(batches.begin(), batches.end(), [](const DedupeBatch &a, const DedupeBatch &b) { return a.fds.size() < b.fds.size(); });
+                held -= fullest->fds.size();
+                flush_dedupe_batch(backend, plan, index.contents[fullest - batches.begin()], *fullest, stats);
+            }
+        }
+
+        for (size_t i = 0; i < batches.size(); i++)
+        {
+            flush_dedupe_batch(backend, plan, index.contents[i], batches[i], stats);
+        }
+    }
+    catch (...)
+    {
+        for (auto &batch : batches)
+        {
+            for (int fd : batch.fds)
+            {
+                backend.close(fd);
+            }
+        }
+        throw;
+    }
+}
+
+// Per-target result of --dry-run, kept in plan order for the --diff list
+enum DiffOutcome : uint8_t
+{
+    DIFF_UNCHECKED,
+    DIFF_SAME,
+    DIFF_CHANGED,
+    DIFF_FAILED,
+};
+
+// Compare every target with its assigned source without writing anything.
+// Targets are spread over --jobs threads, a target that can't be read is
+// reported and counted as failed. The changed ones are listed in --diff
+void perform_diff(Backend &backend, const Plan &plan, const SourceIndex &index, RunStats &stats, const Options &options)
+{
+    size_t count = plan.targets.size();
+    memory_budget.reserve(count, "the diff results");
+    std::vector<uint8_t> outcomes(count, DIFF_UNCHECKED);
+    std::atomic<size_t> next{0};
+    std::mutex report_mutex;
+
+    auto worker = [&](size_t worker_index)
+    {
+        pin_worker(worker_index);
+        Slab &buffer = thread_slab();
+        for (size_t i; !cancel_requested() && (i = next++) < count;)
+        {
+            const ContentEntry &content = index.contents[index.content_of[source_index_for(plan, i)]];
+            try
+            {
+                SourceHandle target = backend.open_existing(plan.targets[i]);
+                bool same;
+                try
+                {
+                    same = holds_contents(backend, target, content, buffer);
+                }
+                catch (...)
+                {
+                    backend.close(target.fd);
+                    throw;
+                }
+                backend.close(target.fd);
+                outcomes[i] = same ? DIFF_SAME : DIFF_CHANGED;
+            }
+            catch (const std::exception &e)
+            {
+                outcomes[i] = DIFF_FAILED;
+                std::lock_guard<std::mutex> lock(report_mutex);
+                std::cerr << "ERROR: " << e.what() << "\n";
+            }
         }
-        else if (arg == "-f" || arg == "--file")
+    };
+
+    size_t thread_count = std::min(options.jobs, count);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < thread_count; i++)
+    {
+        threads.emplace_back(worker, i);
+    }
+    worker(0);
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+
+    std::ofstream list;
+    if (!options.diff_file.empty())
+    {
+        list.open(options.diff_file, std::ios::trunc);
+        if (!list)
         {
-            if (i == argc - 1 || argv[i + 1][0] == '-')
-                throw std::runtime_error("--file requires file");
-            source = argv[i + 1];
-            flags |= Flags::FROM_FILE;
-            beginning_position += 2;
-            i++;
+            memory_budget.release(count);
+            throw std::runtime_error("Failed to open diff file: " + options.diff_file);
         }
-        else if (arg.at(0) == '-')
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        switch (outcomes[i])
         {
-            throw std::runtime_error("Unknown argument: " + std::string(arg));
+        case DIFF_SAME:
+            stats.unchanged_files++;
+            break;
+        case DIFF_CHANGED:
+            stats.changed_files++;
+            stats.changed_bytes += plan.source_sizes[source_index_for(plan, i)];
+            if (list.is_open())
+            {
+                list << plan.targets[i] << "\n";
+            }
+            break;
+        case DIFF_FAILED:
+            stats.failed_files++;
+            break;
         }
     }
+    memory_budget.release(count);
 
-    if (argc != beginning_position + 2)
+    if (list.is_open() && !list.flush())
     {
-        throw std::runtime_error("Unfulfilled arguments");
+        throw std::runtime_error("Failed to write diff file: " + options.diff_file);
     }
-
-    dest_dir = argv[beginning_position];
-    extension = argv[beginning_position + 1];
 }
 
-// Self explanatory
-void copy_file_contents(sv src_file, sv dest_file)
+// The slowest list, slowest first
+std::vector<SlowTarget> slowest_targets(const RunStats &stats)
 {
-    // Open source file
-    std::ifstream src(std::string(src_file), std::ios::binary);
-    if (!src)
-    {
-        throw std::runtime_error("Failed to open source file: " + std::string(src_file));
-    }
+    std::vector<SlowTarget> slowest = stats.slowest;
+    std::sort(slowest.begin(), slowest.end(), [](const SlowTarget &a, const SlowTarget &b) { return a.seconds > b.seconds; });
+    return slowest;
+}
 
-    // Open destination file
-    std::ofstream dst(std::string(dest_file), std::ios::binary);
-    if (!dst)
+// Sources whose targets took the most write time in total, at most SLOWEST_COUNT
+std::vector<size_t> slowest_sources(const RunStats &stats)
+{
+    std::vector<size_t> sources;
+    for (size_t i = 0; i < stats.source_latency.size(); i++)
     {
-        throw std::runtime_error("Failed to open destination file: " + std::string(dest_file));
+        if (stats.source_latency[i].files > 0)
+        {
+            sources.push_back(i);
+        }
     }
-
-    // Copy all contents
-    dst << src.rdbuf();
+    size_t count = std::min(sources.size(), SLOWEST_COUNT);
+    std::partial_sort(sources.begin(), sources.begin() + count, sources.end(), [&](size_t a, size_t b) { return stats.source_latency[a].seconds > stats.source_latency[b].seconds; });
+    sources.resize(count);
+    return sources;
 }
 
-// Prompt user for confirmation
-void confirm_overwrite()
+// Print per-phase timings and counters
+void print_stats(const RunStats &stats, const Plan &plan)
 {
-    std::cout << "Continue? (y/n): ";
-
-    std::string response;
-    std::getline(std::cin, response);
+    const char *counter_names[PERF_COUNT] = {"cycles", "instructions", "ctx-switches", "page-faults"};
+    double write_allocations = 0;
 
-    if (response.empty() || (response.at(0) != 'y' && response.at(0) != 'Y'))
+    std::cout << "INFO: " << std::left << std::setw(10) << "phase" << std::right << std::setw(12) << "time (ms)";
+    for (const char *counter_name : counter_names)
     {
-        exit(1);
+        std::cout << std::setw(15) << counter_name;
     }
-}
+    if (COUNTING_ALLOCATIONS)
+    {
+        std::cout << std::setw(15) << "allocations";
+    }
+    std::cout << "\n";
 
-void perform_write_file(sv src_file, sv dest_dir, sv extension, uint64_t &overwritten_files, uint64_t &flags)
-{
-    // Collect destination files with matching extension
-    std::vector<std::filesystem::path> dest_files;
-    for (const auto &entry : std::filesystem::directory_iterator(dest_dir))
+    for (const auto &phase : stats.phases)
     {
-        if (entry.is_regular_file() && entry.path().extension() == extension)
+        std::cout << "INFO: " << std::left << std::setw(10) << phase.name << std::right << std::setw(12) << std::fixed << std::setprecision(3) << phase.seconds * 1000.0;
+        for (int i = 0; i < PERF_COUNT; i++)
+        {
+            if (stats.perf && stats.perf->available(i))
+            {
+                std::cout << std::setw(15) << phase.counters[i];
+            }
+            else
+            {
+                std::cout << std::setw(15) << "-";
+            }
+        }
+        if (COUNTING_ALLOCATIONS)
         {
-            dest_files.push_back(entry.path());
+            std::cout << std::setw(15) << phase.allocations;
+        }
+        std::cout << "\n";
+
+        // The write loop is expected to be allocation free per target
+        if (COUNTING_ALLOCATIONS && std::strcmp(phase.name, "write") == 0 && stats.overwritten_files > 0)
+        {
+            write_allocations = static_cast<double>(phase.allocations) / stats.overwritten_files;
         }
     }
 
-    // If no destination files were found
-    if (dest_files.empty())
+    if (stats.collapsed_sources > 0)
     {
-        throw std::runtime_error("No destination files found with the given extension");
+        std::cout << "INFO: Identical sources collapsed: " << stats.collapsed_sources << "\n";
+    }
+    if (stats.store_hits + stats.stored_sources > 0)
+    {
+        std::cout << "INFO: Sources found in the store: " << stats.store_hits << ", added to it: " << stats.stored_sources << "\n";
+    }
+    if (stats.cloned_files > 0)
+    {
+        std::cout << "INFO: Targets cloned from an earlier target or the store: " << stats.cloned_files << "\n";
+    }
+    if (stats.retried_files > 0)
+    {
+        std::cout << "INFO: Retries after transient errors: " << stats.retried_files << "\n";
     }
 
-    // Overwrite each destination file
-    for (const auto &dest_path : dest_files)
+    std::cout << "INFO: Peak memory reserved: " << memory_budget.peak() << " of " << memory_budget.limit() << " bytes\n";
+
+    if (!stats.slowest.empty())
     {
-        if (flags & Flags::CONFIRM_EACH)
+        std::cout << "INFO: Slowest targets (ms):\n";
+        for (const auto &slow : slowest_targets(stats))
         {
-            std::cout << "Target: " << dest_path.filename() << "\n";
-            confirm_overwrite();
+            std::cout << "INFO: " << std::setw(12) << std::fixed << std::setprecision(3) << slow.seconds * 1000.0 << "  " << plan.targets[slow.target] << " <- " << filename_of(plan.sources[slow.source]) << "\n";
         }
+    }
+    if (plan.sources.size() > 1 && !stats.slowest.empty())
+    {
+        std::cout << "INFO: Write time by source:\n";
+        std::cout << "INFO: " << std::left << std::setw(20) << "source" << std::right << std::setw(8) << "files" << std::setw(12) << "total (ms)" << std::setw(12) << "mean (ms)" << std::setw(12) << "max (ms)" << "\n";
+        for (size_t source : slowest_sources(stats))
+        {
+            const SourceLatency &latency = stats.source_latency[source];
+            std::cout << "INFO: " << std::left << std::setw(20) << filename_of(plan.sources[source]) << std::right << std::setw(8) << latency.files;
+            std::cout << std::setw(12) << latency.seconds * 1000.0 << std::setw(12) << latency.seconds * 1000.0 / latency.files << std::setw(12) << latency.max_seconds * 1000.0 << "\n";
+        }
+    }
+
+    if (COUNTING_ALLOCATIONS)
+    {
+        std::cout << "INFO: Heap allocations per written file: " << std::setprecision(3) << write_allocations << "\n";
+    }
 
-        copy_file_contents(std::string(src_file), std::string(std::filesystem::absolute(dest_path)));
-        overwritten_files++;
+    if (!stats.perf || !stats.perf->any_available())
+    {
+        std::cout << "INFO: Counters unavailable, check /proc/sys/kernel/perf_event_paranoid\n";
     }
 }
 
-void perform_write_dir(sv source, sv dest_dir, sv extension, uint64_t &overwritten_files, uint64_t &flags)
+// Write run metrics in Prometheus text exposition format. The file is written
+// next to the destination and renamed over it so collectors never read a partial file
+void write_metrics(const std::string &path, const RunStats &stats, bool success)
 {
-    // Collect source files with matching extension
-    std::vector<std::filesystem::path> src_files;
-    for (auto &p : std::filesystem::directory_iterator(source))
+    write_file_atomically(path, "metrics file", [&](std::ostream &out)
     {
-        if (p.is_regular_file() && p.path().extension() == extension)
+        auto counter = [&](const char *name, const char *help_text, uint64_t value)
+        {
+            out << "# HELP " << name << " " << help_text << "\n";
+            out << "# TYPE " << name << " counter\n";
+            out << name << " " << value << "\n";
+        };
+
+        counter("xreplace_files_scanned_total", "Directory entries examined.", stats.scanned_files);
+        counter("xreplace_files_matched_total", "Target files with the requested extension.", stats.matched_files);
+        counter("xreplace_files_written_total", "Target files overwritten.", stats.overwritten_files);
+        counter("xreplace_files_skipped_total", "Matched target files that were not written.", stats.matched_files - stats.overwritten_files - stats.failed_files);
+        counter("xreplace_files_failed_total", "Target files that could not be written.", stats.failed_files);
+        counter("xreplace_files_timed_out_total", "Target files given up on after --target-timeout.", stats.timed_out_files);
+        counter("xreplace_retries_total", "Attempts scheduled again after a transient error.", stats.retried_files);
+        counter("xreplace_bytes_written_total", "Bytes written to target files.", stats.written_bytes);
+        counter("xreplace_files_deduped_total", "Target files made to share extents with their source.", stats.deduped_files);
+        counter("xreplace_bytes_deduped_total", "Bytes of target files now shared with their source.", stats.deduped_bytes);
+        counter("xreplace_files_changed_total", "Target files --dry-run found different from their source.", stats.changed_files);
+        counter("xreplace_files_unchanged_total", "Target files --dry-run found identical to their source.", stats.unchanged_files);
+
+        out << "# HELP xreplace_phase_seconds Wall time spent in each phase.\n";
+        out << "# TYPE xreplace_phase_seconds gauge\n";
+        for (const auto &phase : stats.phases)
         {
-            src_files.push_back(p.path());
+            out << "xreplace_phase_seconds{phase=\"" << phase.name << "\"} " << phase.seconds << "\n";
         }
-    }
 
-    // Collect destination files with matching extension
-    std::vector<std::filesystem::path> dest_files;
-    for (auto &p : std::filesystem::directory_iterator(dest_dir))
-    {
-        if (p.is_regular_file() && p.path().extension() == extension)
+        out << "# HELP xreplace_file_write_seconds Time to write one target file.\n";
+        out << "# TYPE xreplace_file_write_seconds histogram\n";
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < LATENCY_BUCKET_COUNT; i++)
         {
-            dest_files.push_back(p.path());
+            cumulative += stats.latency_buckets[i];
+            out << "xreplace_file_write_seconds_bucket{le=\"" << LATENCY_BUCKETS[i] << "\"} " << cumulative << "\n";
         }
-    }
+        cumulative += stats.latency_buckets[LATENCY_BUCKET_COUNT];
+        out << "xreplace_file_write_seconds_bucket{le=\"+Inf\"} " << cumulative << "\n";
+        out << "xreplace_file_write_seconds_sum " << stats.latency_sum << "\n";
+        out << "xreplace_file_write_seconds_count " << cumulative << "\n";
 
-    if (src_files.empty())
-    {
-        throw std::runtime_error("No source files found with the given extension");
-    }
-    if (dest_files.empty())
+        out << "# HELP xreplace_memory_reserved_peak_bytes Most memory reserved at once from the --max-mem budget.\n";
+        out << "# TYPE xreplace_memory_reserved_peak_bytes gauge\n";
+        out << "xreplace_memory_reserved_peak_bytes " << memory_budget.peak() << "\n";
+
+        out << "# HELP xreplace_last_run_success Whether the last run finished without error.\n";
+        out << "# TYPE xreplace_last_run_success gauge\n";
+        out << "xreplace_last_run_success " << (success ? 1 : 0) << "\n";
+
+        out << "# HELP xreplace_last_run_timestamp_seconds Unix time the last run ended.\n";
+        out << "# TYPE xreplace_last_run_timestamp_seconds gauge\n";
+        out << "xreplace_last_run_timestamp_seconds " << std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "\n";
+    });
+}
+
+// Quoted JSON string. Paths are passed through byte for byte, only quotes,
+// backslashes and control characters are escaped
+std::string json_string(sv text)
+{
+    std::string quoted = "\"";
+    for (char c : text)
     {
-        throw std::runtime_error("No destination files found with the given extension");
+        if (c == '"' || c == '\\')
+        {
+            quoted += '\\';
+            quoted += c;
+        }
+        else if (static_cast<unsigned char>(c) < 0x20)
+        {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            quoted += escaped;
+        }
+        else
+        {
+            quoted += c;
+        }
     }
+    quoted += '"';
+    return quoted;
+}
 
-    // Distribute destination files evenly among source files
-    size_t src_count = src_files.size();
-    size_t dest_count = dest_files.size();
+// Write the run report as JSON, replaced atomically like the metrics file
+void write_json(const std::string &path, const RunStats &stats, const Plan &plan, bool success)
+{
+    write_file_atomically(path, "JSON file", [&](std::ostream &out)
+    {
+        out << "{\n  \"success\": " << (success ? "true" : "false") << ",\n";
+        out << "  \"files\": {\"scanned\": " << stats.scanned_files << ", \"matched\": " << stats.matched_files << ", \"written\": " << stats.overwritten_files;
+        out << ", \"failed\": " << stats.failed_files << ", \"timed_out\": " << stats.timed_out_files << ", \"retried\": " << stats.retried_files;
+        out << ", \"store_hits\": " << stats.store_hits << ", \"stored\": " << stats.stored_sources;
+        out << ", \"cloned\": " << stats.cloned_files << ", \"deduped\": " << stats.deduped_files << ", \"changed\": " << stats.changed_files << ", \"unchanged\": " << stats.unchanged_files << "},\n";
+        out << "  \"bytes\": {\"written\": " << stats.written_bytes << ", \"deduped\": " << stats.deduped_bytes << ", \"changed\": " << stats.changed_bytes;
+        out << ", \"memory_peak\": " << memory_budget.peak() << ", \"memory_limit\": " << memory_budget.limit() << "},\n";
 
-    size_t base_count = dest_count / src_count; // minimum files per source
-    size_t remainder = dest_count % src_count;  // extra files for the first few sources
+        out << "  \"phases\": [";
+        for (size_t i = 0; i < stats.phases.size(); i++)
+        {
+            out << (i ? ", " : "") << "{\"name\": " << json_string(stats.phases[i].name) << ", \"seconds\": " << stats.phases[i].seconds << "}";
+        }
+        out << "],\n";
 
-    auto dest_it = dest_files.begin();
-    for (size_t i = 0; i < src_count; ++i)
-    {
-        size_t count_for_this_src = base_count + (i < remainder ? 1 : 0);
-        for (size_t j = 0; j < count_for_this_src && dest_it != dest_files.end(); ++j, ++dest_it)
+        out << "  \"write_latency\": {\"sum_seconds\": " << stats.latency_sum << ", \"buckets\": [";
+        for (size_t i = 0; i <= LATENCY_BUCKET_COUNT; i++)
         {
-            if (flags & Flags::CONFIRM_EACH)
+            out << (i ? ", " : "") << "{\"le\": ";
+            if (i < LATENCY_BUCKET_COUNT)
+            {
+                out << LATENCY_BUCKETS[i];
+            }
+            else
             {
-                std::cout << "Target: " << dest_it->filename() << "\n";
-                confirm_overwrite();
+                out << "null";
             }
-            copy_file_contents(std::string(src_files[i]), std::string(std::filesystem::absolute(*dest_it)));
-            overwritten_files++;
+            out << ", \"count\": " << stats.latency_buckets[i] << "}";
         }
-    }
+        out << "]},\n";
+
+        out << "  \"slowest_targets\": [";
+        std::vector<SlowTarget> slowest = slowest_targets(stats);
+        for (size_t i = 0; i < slowest.size(); i++)
+        {
+            out << (i ? ",\n    " : "\n    ") << "{\"path\": " << json_string(plan.targets[slowest[i].target]) << ", \"source\": " << json_string(plan.sources[slowest[i].source]);
+            out << ", \"seconds\": " << slowest[i].seconds << "}";
+        }
+        out << (slowest.empty() ? "" : "\n  ") << "],\n";
+
+        out << "  \"sources\": [";
+        std::vector<size_t> sources = slowest_sources(stats);
+        for (size_t i = 0; i < sources.size(); i++)
+        {
+            const SourceLatency &latency = stats.source_latency[sources[i]];
+            out << (i ? ",\n    " : "\n    ") << "{\"path\": " << json_string(plan.sources[sources[i]]) << ", \"files\": " << latency.files;
+            out << ", \"seconds\": " << latency.seconds << ", \"max_seconds\": " << latency.max_seconds << "}";
+        }
+        out << (sources.empty() ? "" : "\n  ") << "]\n}\n";
+    });
 }
 
-void validate_arguments(sv source, sv dest_dir, sv extension, const uint64_t flags)
+// Each path is looked up once, the source's status is kept for build_plan
+void validate_arguments(Backend &backend, const std::string &source, const std::string &dest_dir, sv extension, const uint64_t flags, FileStatus &source_status)
 {
     // Check if any required arguments are empty
     if (source.empty() || dest_dir.empty() || extension.empty())
@@ -272,28 +5694,30 @@ void validate_arguments(sv source, sv dest_dir, sv extension, const uint64_t fla
         throw std::runtime_error("Cannot specify both --file and --dir");
     }
 
+    source_status = backend.stat(source.c_str());
+
     // Verify that source is valid (as directory)
     if (flags & Flags::FROM_DIR)
     {
-        if (!(std::filesystem::exists(source) && std::filesystem::is_directory(source)))
+        if (!source_status.is_directory)
         {
-            throw std::runtime_error("Directory is invalid: " + std::string(source));
+            throw std::runtime_error("Directory is invalid: " + source);
         }
     }
 
     // Verify that source is valid (as file)
     if (flags & Flags::FROM_FILE)
     {
-        if (!(std::filesystem::exists(source) && std::filesystem::is_regular_file(source)))
+        if (!source_status.is_regular)
         {
-            throw std::runtime_error("File is invalid: " + std::string(source));
+            throw std::runtime_error("File is invalid: " + source);
         }
     }
 
     // Verify that dest_dir is valid
-    if (!(std::filesystem::exists(dest_dir) && std::filesystem::is_directory(dest_dir)))
+    if (!backend.stat(dest_dir.c_str()).is_directory)
     {
-        throw std::runtime_error("Directory is invalid: " + std::string(dest_dir));
+        throw std::runtime_error("Directory is invalid: " + dest_dir);
     }
 
     // Verify that extension is valid
@@ -309,42 +5733,371 @@ int main(int argc, char **argv)
     std::string dest_dir;
     std::string extension;
     uint64_t flags = 0;
-    uint64_t overwritten_files = 0;
+    Options options;
+    RunStats stats;
+    bool success = true;
+
+    // Outside the try block: jobs abandoned by --target-timeout may still use them
+    std::unique_ptr<Backend> backend;
+    Plan plan;
+    SourceIndex index;
+    std::unique_ptr<SourceStore> store;
+    Cursor cursor;
+    FileStatus source_status;
+    size_t position = 0;
+    bool writing = false; // position follows the write loop, also when it failed
+    size_t unlisted = 0; // --targets-from lines that matched no target
 
     try
     {
         // Set up arguments
-        handle_arguments(argc, argv, source, dest_dir, extension, flags);
-        validate_arguments(source, dest_dir, extension, flags);
+        handle_arguments(argc, argv, source, dest_dir, extension, flags, options);
+        memory_budget.set_limit(options.max_mem > 0 ? options.max_mem : default_memory_limit());
+        apply_fd_limit(options);
+
+        // Pick the file system implementation
+        if (options.simulate.empty())
+        {
+            backend = std::make_unique<PosixBackend>();
+        }
+        else
+        {
+            backend = std::make_unique<MemoryBackend>(parse_simulation_spec(options.simulate), source, dest_dir, extension, flags);
+        }
+
+        if (!options.store_dir.empty())
+        {
+            if (!options.simulate.empty())
+            {
+                throw std::runtime_error("--store can not be combined with --simulate");
+            }
+            store = std::make_unique<SourceStore>(options.store_dir, flags & Flags::DECOMPRESS);
+        }
+        if ((flags & Flags::FROM_FILE) && source[0] == '@')
+        {
+            if (!store)
+            {
+                throw std::runtime_error("--file @<hash> requires --store");
+            }
+            source = store->resolve(sv(source).substr(1));
+        }
+
+        validate_arguments(*backend, source, dest_dir, extension, flags, source_status);
+
+        if ((options.limited() || !options.cursor_file.empty()) && (flags & Flags::DEDUPE_EXISTING))
+        {
+            throw std::runtime_error("--deadline, --max-bytes, --max-files and --cursor can not be combined with --dedupe-existing");
+        }
+        if (flags & Flags::DRY_RUN)
+        {
+            if (options.limited() || !options.cursor_file.empty() || (flags & Flags::DEDUPE_EXISTING))
+            {
+                throw std::runtime_error("--deadline, --max-bytes, --max-files, --cursor and --dedupe-existing can not be combined with --dry-run");
+            }
+        }
+        else if (!options.diff_file.empty())
+        {
+            throw std::runtime_error("--diff requires --dry-run");
+        }
+        if ((flags & Flags::BROWSE) && !options.cursor_file.empty())
+        {
+            throw std::runtime_error("--browse can not be combined with --cursor, positions would shift with the selection");
+        }
+        if (!options.cursor_file.empty())
+        {
+            cursor = load_cursor(options.cursor_file);
+        }
+
+        // A resumed run has to keep the assignment it started with
+        if (options.random_distribution)
+        {
+            if (!options.seed && cursor.seed)
+            {
+                options.seed = cursor.seed;
+            }
+            else if (!options.seed)
+            {
+                std::random_device device;
+                options.seed = (static_cast<uint64_t>(device()) << 32) | device();
+                std::cout << "INFO: Random distribution seed: " << *options.seed << "\n";
+            }
+            cursor.seed = options.seed;
+        }
+
+        if (!(flags & (Flags::FROM_FILE | Flags::FROM_DIR)))
+        {
+            throw std::runtime_error("Invalid argument");
+        }
+
+        // Open counters before any worker threads exist so they are inherited
+        if (flags & Flags::STATS)
+        {
+            stats.perf = std::make_unique<PerfCounters>();
+        }
+
+        install_signal_handlers();
+
+        if (flags & Flags::PIN_CPUS)
+        {
+            init_worker_cpus();
+            pin_worker(0);
+        }
+
+        // Scan, plan and read sources in the background while the prompt waits for the
+        // user. Without a prompt there is nothing to overlap and a thread start to save
+        bool interactive = !(flags & (Flags::SKIP_CONFIRMATION | Flags::DRY_RUN)) || (flags & Flags::BROWSE);
+        std::promise<void> scanned;
+        std::future<void> scan_done = scanned.get_future();
+        std::future<void> prepared = std::async(interactive ? std::launch::async : std::launch::deferred, [&]()
+        {
+            try
+            {
+                PhaseScope phase(stats, "scan");
+                plan = build_plan(*backend, source, source_status, dest_dir, extension, stats, flags);
+                if (options.random_distribution)
+                {
+                    plan.shuffle.emplace(plan.assigned_targets, *options.seed);
+                }
+                if (!options.targets_from.empty())
+                {
+                    unlisted = select_targets(plan, options.targets_from);
+                }
+
+                uint64_t fingerprint = plan_fingerprint(plan, options);
+                if (cursor.loaded && (cursor.plan != fingerprint || cursor.position > plan.targets.size()))
+                {
+                    throw std::runtime_error("Cursor file " + options.cursor_file + " belongs to different sources, targets or seed, delete it to start over");
+                }
+                cursor.plan = fingerprint;
+            }
+            catch (...)
+            {
+                scanned.set_exception(std::current_exception());
+                return;
+            }
+            // Nothing grows when only deduplicating or comparing
+            if (!(flags & (Flags::DEDUPE_EXISTING | Flags::DRY_RUN)))
+            {
+                try
+                {
+                    PhaseScope phase(stats, "preflight");
+                    check_space(*backend, plan, cursor.position);
+                }
+                catch (...)
+                {
+                    scanned.set_exception(std::current_exception());
+                    return;
+                }
+            }
+            scanned.set_value();
+
+            // Hash sources and collapse identical ones
+            if (store || (flags & (Flags::FROM_DIR | Flags::DEDUPE_EXISTING | Flags::DRY_RUN)) || ((flags & Flags::DECOMPRESS) && is_compressed_file(*backend, plan.sources[0])))
+            {
+                PhaseScope phase(stats, "index");
+                index = build_source_index(*backend, plan, stats, store.get(), flags & Flags::DECOMPRESS);
+            }
+        });
+        if (!interactive)
+        {
+            prepared.wait();
+        }
 
         // Ask the user to continue
-        if (!(flags & Flags::SKIP_CONFIRMATION))
+        bool ask = !(flags & (Flags::SKIP_CONFIRMATION | Flags::DRY_RUN));
+        if (ask)
         {
             std::cout << "Target directory: " << dest_dir << "\n";
+        }
+
+        scan_done.get();
+        if (unlisted > 0)
+        {
+            std::cout << "INFO: " << unlisted << " targets listed in " << options.targets_from << " were not found\n";
+        }
+        if (flags & Flags::BROWSE)
+        {
+            std::cout.flush();
+            std::vector<bool> keep;
+            if (!browse_plan(plan, keep))
+            {
+                exit(1);
+            }
+            // The index thread only reads sources, targets can change under it
+            if (std::find(keep.begin(), keep.end(), false) != keep.end())
+            {
+                keep_targets(plan, keep);
+            }
+            ask = ask && !cancel_requested();
+        }
+        if (cursor.position == plan.targets.size())
+        {
+            std::cout << "INFO: Cursor is at the end of the plan, nothing left to write\n";
+            ask = false;
+        }
+        if (ask)
+        {
+            std::cout << "Targets: " << plan.targets.size() << " files, " << planned_bytes(plan) << " bytes\n";
+            if (cursor.position > 0)
+            {
+                std::cout << "Resuming at target " << cursor.position + 1 << " of " << plan.targets.size() << "\n";
+            }
             confirm_overwrite();
         }
 
-        // Perform the write
-        if (flags & Flags::FROM_FILE)
+        prepared.get();
+        if (store)
+        {
+            store->save();
+            // A cancelled index comes back empty
+            const std::string stored = index.contents.empty() ? std::string() : index.contents[0].stored;
+            if ((flags & Flags::FROM_FILE) && !stored.empty() && stored != source)
+            {
+                std::cout << "INFO: " << source << " is stored as @" << filename_of(stored).substr(0, 16) << "\n";
+            }
+        }
+
+        // Decompressed sources can need more space than the preflight assumed
+        if (apply_indexed_sizes(plan, index) && !(flags & (Flags::DEDUPE_EXISTING | Flags::DRY_RUN)))
         {
-            perform_write_file(source, dest_dir, extension, overwritten_files, flags);
+            check_space(*backend, plan, cursor.position);
         }
-        else if (flags & Flags::FROM_DIR)
+
+        if (flags & Flags::DEDUPE_EXISTING)
+        {
+            PhaseScope phase(stats, "dedupe");
+            perform_dedupe(*backend, plan, index, stats, options);
+        }
+        else if (flags & Flags::DRY_RUN)
         {
-            perform_write_dir(source, dest_dir, extension, overwritten_files, flags);
+            PhaseScope phase(stats, "diff");
+            perform_diff(*backend, plan, index, stats, options);
+            position = stats.changed_files + stats.unchanged_files + stats.failed_files;
         }
         else
         {
-            throw std::runtime_error("Invalid argument");
+            PhaseScope phase(stats, "write");
+            position = cursor.position;
+            writing = true;
+            perform_write(*backend, plan, index, stats, options, flags, position);
+        }
+
+        if (!options.cursor_file.empty())
+        {
+            cursor.position = position;
+            save_cursor(options.cursor_file, cursor);
         }
     }
     catch (const std::exception &e)
     {
         std::cerr << "ERROR: " + std::string(e.what()) + "\n";
         std::cerr << "INFO: Try --help" << std::endl;
+        success = false;
+    }
+
+    // A failed write loop still got somewhere, the next run starts from there
+    if (!success && writing && !options.cursor_file.empty())
+    {
+        try
+        {
+            cursor.position = position;
+            save_cursor(options.cursor_file, cursor);
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "ERROR: " + std::string(e.what()) + "\n";
+        }
+    }
+
+    // Metrics are exported for failed runs too, as long as a run was started
+    if (!options.metrics_file.empty() && !stats.phases.empty())
+    {
+        try
+        {
+            write_metrics(options.metrics_file, stats, success && !cancel_requested());
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "ERROR: " + std::string(e.what()) + "\n";
+            return 1;
+        }
+    }
+    if (!options.json_file.empty() && !stats.phases.empty())
+    {
+        try
+        {
+            write_json(options.json_file, stats, plan, success && !cancel_requested());
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "ERROR: " + std::string(e.what()) + "\n";
+            return 1;
+        }
+    }
+
+    if (!success)
+    {
+        if (stats.timed_out_files > 0)
+        {
+            std::_Exit(1);
+        }
         return 1;
     }
 
-    std::cout << "INFO: Overwritten files: " << overwritten_files << std::endl;
-    return 0;
+    if (flags & Flags::DEDUPE_EXISTING)
+    {
+        std::cout << "INFO: Deduplicated files: " << stats.deduped_files << " (" << stats.deduped_bytes << " bytes now shared)" << std::endl;
+    }
+    else if (flags & Flags::DRY_RUN)
+    {
+        std::cout << "INFO: Would change: " << stats.changed_files << " files (" << stats.changed_bytes << " bytes to write)\n";
+        std::cout << "INFO: Unchanged: " << stats.unchanged_files << " files\n";
+        std::cout << "INFO: Could not compare: " << stats.failed_files << " files" << std::endl;
+        if (!options.diff_file.empty())
+        {
+            std::cout << "INFO: Changed targets saved to " << options.diff_file << std::endl;
+        }
+    }
+    else
+    {
+        std::cout << "INFO: Overwritten files: " << stats.overwritten_files << std::endl;
+    }
+
+    if (cancel_requested())
+    {
+        std::cout << "INFO: Cancelled, " << plan.targets.size() - position << " targets left untouched" << std::endl;
+    }
+    else if (!(flags & Flags::DEDUPE_EXISTING) && position < plan.targets.size())
+    {
+        std::cout << "INFO: Limit reached, " << plan.targets.size() - position << " targets left";
+        if (!options.cursor_file.empty())
+        {
+            std::cout << ", run again with --cursor " << options.cursor_file << " to continue";
+        }
+        std::cout << std::endl;
+    }
+
+    if (stats.timed_out_files > 0)
+    {
+        std::cout << "INFO: Timed out files: " << stats.timed_out_files << std::endl;
+    }
+
+    if (flags & Flags::STATS)
+    {
+        print_stats(stats, plan);
+    }
+
+    int status = stats.failed_files > 0 ? 1 : 0;
+    if (cancel_requested())
+    {
+        status = 128 + cancel_signal.load();
+    }
+
+    // Abandoned jobs may still be blocked on a hung mount, don't tear down what they use
+    if (stats.timed_out_files > 0)
+    {
+        std::cout.flush();
+        std::_Exit(status);
+    }
+    return status;
 }
@@ -0,0 +1,42 @@
+#!/bin/bash
+# Heap allocations of the write phase per target, from the difference between
+# runs with N and 2*N targets so the warm-up of pools and tables cancels out.
+# Fails unless the write loop allocates nothing per target once warmed up.
+# With executor threads (-j, --target-timeout) the warm-up depends a little on
+# how many calls happen to be in flight at once, those runs get a slack of one
+# allocation per 100 targets.
+# Usage: test/allocation_budget.sh <xreplace built with COUNT_ALLOCATIONS=1>
+set -euo pipefail
+
+xreplace=$(realpath "$1")
+targets=${TARGETS:-1000}
+source "$(dirname "$0")/common.sh"
+
+# Allocations column of the write phase in --stats, the rest of the arguments are passed to xreplace
+count()
+{
+    "$xreplace" -y -s "$@" | awk '$2 == "write" { print $NF; found = 1 } END { exit !found }'
+}
+
+check()
+{
+    local name=$1 slack=${2:-0}
+    if [ "$large" -gt $((small + slack)) ]; then
+        report 0 "$name: $((large - small)) more allocations for $targets more targets"
+    else
+        report 1 "$name: $small allocations in the write phase for $targets and for $((targets * 2)) targets"
+    fi
+}
+
+for mode in file dir; do
+    measure posix "$mode"
+    check "posix --$mode"
+
+    measure simulate "$mode"
+    check "simulate --$mode"
+
+    measure simulate "$mode" -j 4 --target-timeout 5s
+    check "simulate --$mode -j 4 --target-timeout 5s" $((targets / 100))
+done
+
+exit $failed
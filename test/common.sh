@@ -0,0 +1,54 @@
+# Shared by the budget tests, which measure a run of xreplace with N and with
+# 2*N targets so that start-up and warm-up cancel out in the difference.
+# Scripts set targets and define count, which runs xreplace with the given
+# arguments (plus -y) and prints the measured number.
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+failed=0
+
+# Generated tree with the given number of targets and two sources
+make_tree()
+{
+    rm -rf "$work/src" "$work/dst"
+    mkdir -p "$work/src" "$work/dst"
+    echo "first source" > "$work/src/a.obj"
+    echo "second source" > "$work/src/b.obj"
+    for ((i = 0; i < $1; i++)); do
+        echo "old $i" > "$work/dst/t$i.obj"
+    done
+}
+
+# Counts for N and 2*N targets in small and large.
+# Usage: measure <posix|simulate> <file|dir> [xreplace options...]
+measure()
+{
+    local backend=$1 mode=$2
+    shift 2
+    if [ "$backend" = simulate ]; then
+        small=$(count "$@" --simulate "files=$targets,sources=2" "--$mode" /sim/src /sim/dst .obj)
+        large=$(count "$@" --simulate "files=$((targets * 2)),sources=2" "--$mode" /sim/src /sim/dst .obj)
+        return
+    fi
+
+    local source_args=(--file "$work/src/a.obj")
+    if [ "$mode" = dir ]; then
+        source_args=(--dir "$work/src")
+    fi
+    make_tree "$targets"
+    small=$(count "$@" "${source_args[@]}" "$work/dst" .obj)
+    make_tree $((targets * 2))
+    large=$(count "$@" "${source_args[@]}" "$work/dst" .obj)
+}
+
+# Prints the outcome of one check and remembers a failure for the exit status.
+# Usage: report <passed> <message>
+report()
+{
+    if [ "$1" = 1 ]; then
+        echo "ok:   $2"
+    else
+        echo "FAIL: $2"
+        failed=1
+    fi
+}
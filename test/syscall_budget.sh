@@ -0,0 +1,41 @@
+#!/bin/bash
+# System calls per target for each backend, from the difference between runs
+# with N and 2*N targets so start-up and per-source work cancel out.
+# Fails when a backend needs more than its budget:
+#   posix     3 (open, copy_file_range or write, close)
+#   simulate  0 (the in-memory file system makes none)
+# Usage: test/syscall_budget.sh <xreplace> <shim.so>
+set -euo pipefail
+
+xreplace=$(realpath "$1")
+shim=$(realpath "$2")
+targets=${TARGETS:-500}
+source "$(dirname "$0")/common.sh"
+
+# Counted calls of one run, the rest of the arguments are passed to xreplace.
+# A static build can't load the shim and leaves no count, which fails the test
+count()
+{
+    rm -f "$work/count"
+    SYSCALL_COUNT_FILE="$work/count" LD_PRELOAD="$shim" "$xreplace" -y "$@" >/dev/null
+    cat "$work/count"
+}
+
+check()
+{
+    local name=$1 budget=$2
+    local per_target
+    per_target=$(awk -v a="$small" -v b="$large" -v n="$targets" 'BEGIN { printf "%.2f", (b - a) / n }')
+    report "$(awk -v p="$per_target" -v b="$budget" 'BEGIN { print (p <= b) }')" \
+        "$name: $per_target system calls per target, budget $budget"
+}
+
+for mode in file dir; do
+    measure posix "$mode"
+    check "posix --$mode" 3
+
+    measure simulate "$mode"
+    check "simulate --$mode" 0
+done
+
+exit $failed